@@ -11,6 +11,7 @@
 #include "../plugin.h"
 #include "rumble.h"
 #include "sound.h"
+#include "soundcache.h"
 #include "user.h"
 
 struct environment * environment_new(struct client *c) {
@@ -33,6 +34,11 @@ struct environment * environment_new(struct client *c) {
 	pthread_cond_init(&env->sound.playback.notify, NULL);
 	//env->sound.playback.enabled = TRUE;
 	env->sound.playback.current = NULL;
+	env->sound.playback.prefetch = NULL;
+	env->sound.playback.generation = 0;
+	env->sound.playback.prefetch_empty = FALSE;
+	env->sound.playback.cache = soundcache_new(SOUNDCACHE_PACKET_BUDGET);
+	env->sound.playback.pcm = (settings.pcm_cache > 0) ? soundcache_pcm_cache_new((size_t) settings.pcm_cache * 1024 * 1024) : NULL;
 	sound_start_playback(env);
 
 	pthread_mutex_init(&env->sound.m_stream, NULL);
@@ -68,6 +74,8 @@ void environment_free(struct environment *env) {
 	pthread_cond_destroy(&env->sound.playback.notify);
 	pthread_mutex_destroy(&env->sound.m_playback);
 	if (env->sound.playback.cencoder) env->sound.playback.cc->encoder_destroy(env->sound.playback.cencoder);
+	soundcache_free(env->sound.playback.cache);
+	if (env->sound.playback.pcm) soundcache_pcm_cache_free(env->sound.playback.pcm);
 
 
 	if (env->sound.stream.enabled) sound_destroy_stream(env->client);
@@ -19,6 +19,7 @@
 #include "event.h"
 #include "../plugin.h"
 #include "sound.h"
+#include "soundcache.h"
 #include "../timer.h"
 #include "../types.h"
 
@@ -108,9 +109,28 @@ static int sound_update_celt_encoder(struct client *c, struct celtcodec **cc, CE
 	return use;
 }
 
+static int sound_packet_type(int use) {
+	switch (use) {
+		case CELT_ALPHA:
+			return UDP_TYPE_CELT_ALPHA;
+		case CELT_OPUS:
+			return UDP_TYPE_OPUS;
+		default:
+			return UDP_TYPE_CELT_BETA;
+	}
+}
+
 static bool sound_update_celt_decoder(struct client *c, int type, struct celtcodec **cc, CELTDecoder **cdecoder) {
-	int use = (type == UDP_TYPE_CELT_ALPHA) ? CELT_ALPHA : CELT_BETA;
-	struct celtcodec *_cc = celtcodec_get(client_get_celt_codec_version(c, &use));
+	struct celtcodec *_cc;
+
+	/* there is only one Opus bitstream, whatever was negotiated */
+	if (type == UDP_TYPE_OPUS) {
+		_cc = celtcodec_get(OPUS_BITSTREAM_VERSION);
+	} else {
+		int use = (type == UDP_TYPE_CELT_ALPHA) ? CELT_ALPHA : CELT_BETA;
+		_cc = celtcodec_get(client_get_celt_codec_version(c, &use));
+	}
+
 	if (!_cc) return FALSE;
 
 	if (!*cc) {
@@ -127,7 +147,7 @@ static bool sound_update_celt_decoder(struct client *c, int type, struct celtcod
 	return TRUE;
 }
 
-static void sound_adjust_volume(audio_frame *f, int n, float v) {
+void sound_adjust_volume(audio_frame *f, int n, float v) {
 	if (v == 1.0f) return;
 
 	int i, j;
@@ -316,176 +336,685 @@ static void sound_av_input_close(struct av_input *in) {
 	}
 }
 
-static int sound_extract_raw_audio(const char *input, int type, audio_frame **frames, ...) {
-	AVFormatContext *fctx = NULL;
-	struct av_input in;
-
+static int sound_decoder_input_open(struct av_input *in, const char *name, int type, ...) {
 	va_list args;
-	va_start(args, frames);
+	va_start(args, type);
+
+	int r = sound_av_input_open(in, name, type, args);
+
+	va_end(args);
+
+	return r;
+}
+
+static void sound_decoder_close(struct sound_decoder *d) {
+	if (d->has_packet) av_free_packet(&d->packet);
+
+	av_free(d->frame);
+
+	if (d->pcm) free(d->pcm);
 
-	if (sound_av_input_open(&in, input, type, args)) {
-		va_end(args);
+	audio_resample_close(d->sctx);
+
+	avcodec_close(d->cctx);
+
+	sound_av_input_close(&d->in);
+}
+
+static int64_t sound_decoder_start_time(struct sound_decoder *d) {
+	return d->audio->start_time != AV_NOPTS_VALUE ? d->audio->start_time : 0;
+}
+
+/*
+ * seeks the demuxer to the closest point before sample, the exact position
+ * is only known from the first packet read afterwards
+ */
+static int sound_decoder_seek(struct sound_decoder *d, int64_t sample) {
+	AVRational samples = { 1, SAMPLE_RATE };
+
+	int64_t ts = sound_decoder_start_time(d) + av_rescale_q(sample, samples, d->audio->time_base);
+
+	if (av_seek_frame(d->in.fctx, d->audio->index, ts, AVSEEK_FLAG_BACKWARD) < 0) {
+		console_debug(_CLASS, "ffmpeg", "failed to seek in input %s, decoding up to the start of the range\n", d->in.name);
 
 		return -1;
 	}
 
-	va_end(args);
+	avcodec_flush_buffers(d->cctx);
+
+	d->target = sample;
+	d->seek = TRUE;
+
+	return 0;
+}
+
+/*
+ * turns the pending seek target into the number of samples left to discard;
+ * if the position cannot be told, the input is rewound and decoded up to the
+ * target instead, in which case the current packet has to be dropped (-1)
+ */
+static int sound_decoder_seek_position(struct sound_decoder *d) {
+	int64_t ts = d->packet.pts != AV_NOPTS_VALUE ? d->packet.pts : d->packet.dts;
+
+	d->seek = FALSE;
+
+	if (ts != AV_NOPTS_VALUE) {
+		AVRational samples = { 1, SAMPLE_RATE };
+
+		int64_t pos = av_rescale_q(ts - sound_decoder_start_time(d), d->audio->time_base, samples);
+
+		d->skip = d->target > pos ? d->target - pos : 0;
+
+		return 0;
+	}
+
+	d->skip = d->target;
+
+	if (av_seek_frame(d->in.fctx, d->audio->index, sound_decoder_start_time(d), AVSEEK_FLAG_BACKWARD) < 0) {
+		console_debug(_CLASS, "ffmpeg", "failed to rewind input %s, range starts at an unknown position\n", d->in.name);
+
+		d->skip = 0;
+
+		return 0;
+	}
+
+	avcodec_flush_buffers(d->cctx);
+
+	console_debug(_CLASS, "ffmpeg", "unknown position after seeking in input %s, decoding up to the start of the range\n", d->in.name);
+
+	return -1;
+}
 
-	fctx = in.fctx;
+/* a buffer input hands its data over to ffmpeg, even if opening fails */
+static int sound_decoder_open(struct sound_decoder *d, struct input *input) {
+	const char *name;
+
+	if (input->type == SOUND_INPUT_TYPE_FILE) {
+		name = input->file;
+		if (sound_decoder_input_open(&d->in, name, SOUND_INPUT_TYPE_FILE)) return -1;
+	} else if (input->type == SOUND_INPUT_TYPE_BUFFER) {
+		name = input->buffer.name;
+		if (sound_decoder_input_open(&d->in, name, SOUND_INPUT_TYPE_BUFFER, input->buffer.data, input->buffer.len)) return -1;
+	} else {
+		return -1;
+	}
+
+	AVFormatContext *fctx = d->in.fctx;
 
 	if (av_find_stream_info(fctx) < 0) {
-		console_error(_CLASS, "ffmpeg", "could not locate stream info for input %s\n", input);
+		console_error(_CLASS, "ffmpeg", "could not locate stream info for input %s\n", name);
 
-		sound_av_input_close(&in);
+		sound_av_input_close(&d->in);
 
 		return -1;
 	}
 
-	AVStream *audio = NULL;
-	
+	d->audio = NULL;
+
 	int i;
 	for (i = 0; i < fctx->nb_streams; i++) {
 		// libavcodec 52.20.0 fix
 		if (fctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO) {
 		//if (fctx->streams[i]->codec->codec_type == CODEC_TYPE_AUDIO) {
-			audio = fctx->streams[i];
+			d->audio = fctx->streams[i];
 			break;
 		}
 	}
 
-	if (!audio) {
-		console_error(_CLASS, "ffmpeg", "could not locate audio stream in input %s\n", input);
+	if (!d->audio) {
+		console_error(_CLASS, "ffmpeg", "could not locate audio stream in input %s\n", name);
 
-		sound_av_input_close(&in);
+		sound_av_input_close(&d->in);
 
 		return -1;
 	}
 
-	AVCodecContext *cctx = audio->codec;
-	AVCodec *c = avcodec_find_decoder(cctx->codec_id);
+	d->cctx = d->audio->codec;
+	AVCodec *c = avcodec_find_decoder(d->cctx->codec_id);
 	if (!c) {
-		console_error(_CLASS, "ffmpeg", "input %s requires unavailable decoder for codec %s\n", input, cctx->codec_name);
+		console_error(_CLASS, "ffmpeg", "input %s requires unavailable decoder for codec %s\n", name, d->cctx->codec_name);
 
-		sound_av_input_close(&in);
+		sound_av_input_close(&d->in);
 
 		return -1;
 	}
 
-	if (avcodec_open(cctx, c) < 0) {
-		console_error(_CLASS, "ffmpeg", "failed to initialize codec %s for audio stream in input %s\n", cctx->codec_name, input);
+	if (avcodec_open(d->cctx, c) < 0) {
+		console_error(_CLASS, "ffmpeg", "failed to initialize codec %s for audio stream in input %s\n", d->cctx->codec_name, name);
 
-		sound_av_input_close(&in);
+		sound_av_input_close(&d->in);
 
 		return -1;
 	}
 
-	ReSampleContext *sctx = av_audio_resample_init(CHANNELS, cctx->channels, SAMPLE_RATE, cctx->sample_rate, SAMPLE_FMT_S16, cctx->sample_fmt, 0, 0, 0, 0);
-	if (!sctx) {
-		console_error(_CLASS, "ffmpeg", "failed to create resample context for audio stream in input %s\n", input);
+	d->sctx = av_audio_resample_init(CHANNELS, d->cctx->channels, SAMPLE_RATE, d->cctx->sample_rate, SAMPLE_FMT_S16, d->cctx->sample_fmt, 0, 0, 0, 0);
+	if (!d->sctx) {
+		console_error(_CLASS, "ffmpeg", "failed to create resample context for audio stream in input %s\n", name);
 
-		avcodec_close(cctx);
+		avcodec_close(d->cctx);
 
-		sound_av_input_close(&in);
+		sound_av_input_close(&d->in);
 
 		return -1;
 	}
 
-	AVPacket packet;
-	av_init_packet(&packet);
+	av_init_packet(&d->packet);
+	d->has_packet = FALSE;
+	d->data = NULL;
+	d->size = 0;
+
+	d->frame = av_malloc(AVCODEC_MAX_AUDIO_FRAME_SIZE);
+
+	d->pcm = NULL;
+	d->pcm_size = 0;
+	d->pcm_len = 0;
+	d->pcm_off = 0;
+
+	d->skip = 0;
+	d->left = -1;
+	d->seek = FALSE;
+
+	if (input->from >= 0 && input->to >= 0) {
+		if (input->to <= input->from) {
+			console_error(_CLASS, "ffmpeg", "invalid range %.2f - %.2f for input %s\n", input->from, input->to, name);
+
+			sound_decoder_close(d);
+
+			return -1;
+		}
+
+		d->skip = (int64_t) (input->from * FRAMES_PER_SECOND) * FRAME_SIZE;
+		d->left = (int64_t) ((input->to - input->from) * FRAMES_PER_SECOND) * FRAME_SIZE;
+
+		/* if seeking fails, everything before the range is decoded and discarded */
+		if (d->skip) sound_decoder_seek(d, d->skip);
+	}
+
+	return 0;
+}
+
+/* appends the next decoded and resampled chunk to the pcm buffer, returns 0 at the end of the input */
+static int sound_decoder_decode(struct sound_decoder *d) {
+	while (TRUE) {
+		if (d->size <= 0) {
+			if (d->has_packet) {
+				av_free_packet(&d->packet);
+				d->has_packet = FALSE;
+			}
+
+			if (av_read_frame(d->in.fctx, &d->packet)) return 0;
+
+			d->has_packet = TRUE;
+
+			if (d->packet.stream_index != d->audio->index) continue;
+
+			if (d->seek && sound_decoder_seek_position(d)) continue;
+
+			d->data = d->packet.data;
+			d->size = d->packet.size;
+		}
+
+		/* the packet itself keeps its original data pointer for av_free_packet */
+		AVPacket packet = d->packet;
+		packet.data = d->data;
+		packet.size = d->size;
+
+		int n = AVCODEC_MAX_AUDIO_FRAME_SIZE;
+
+		int r;
+		// libav* 52.20.0 fix
+		if ((r = avcodec_decode_audio3(d->cctx, d->frame, &n, &packet)) <= 0) {
+			d->size = 0;
+			continue;
+		}
+
+		d->data += r;
+		d->size -= r;
+
+		if (!n) continue;
+
+		int samples = n / (sizeof(int16_t) * d->cctx->channels);
+
+		/* leaves room for upsampling and the resampler's filter delay */
+		int size = d->pcm_len + (int) ((int64_t) samples * SAMPLE_RATE / d->cctx->sample_rate) + FRAME_SIZE;
+		if (size > d->pcm_size) {
+			d->pcm = realloc(d->pcm, size * sizeof(int16_t));
+			d->pcm_size = size;
+		}
+
+		int s;
+		if ((s = audio_resample(d->sctx, d->pcm + d->pcm_len, d->frame, samples)) > 0) {
+			d->pcm_len += s;
+
+			return s;
+		}
+	}
+}
+
+/*
+ * fills up to n frames from the input, honouring the requested range; the
+ * last frame is padded with silence, less than n frames means end of input
+ */
+static int sound_decoder_read(struct sound_decoder *d, audio_frame *frames, int n) {
+	int i = 0;
 
-	int _n = 0;
-	int16_t *_frames = NULL;
+	while (i < n && d->left) {
+		int avail = d->pcm_len - d->pcm_off;
 
-	while (av_read_frame(fctx, &packet) == 0) {
-		if (packet.stream_index == audio->index) {
-			uint8_t *_data = packet.data;
-			int _size = packet.size;
+		if (d->skip && avail) {
+			int k = min(d->skip, avail);
+			d->pcm_off += k;
+			d->skip -= k;
 
-			uint8_t *data = _data;
-			int size = _size;
+			continue;
+		}
 
-			int j = 0;
+		int want = FRAME_SIZE;
+		if (d->left >= 0 && d->left < want) want = d->left;
 
-			while (size > 0) {	
-				packet.data = data;
-				packet.size = size;
+		if (avail >= want) {
+			memcpy(frames[i], d->pcm + d->pcm_off, want * sizeof(int16_t));
+			if (want < FRAME_SIZE) memset(frames[i] + want, 0, (FRAME_SIZE - want) * sizeof(int16_t));
 
-				int16_t *frame = av_malloc(AVCODEC_MAX_AUDIO_FRAME_SIZE);
-				int n = AVCODEC_MAX_AUDIO_FRAME_SIZE;
+			d->pcm_off += want;
+			if (d->left > 0) d->left -= want;
 
-				int d;
-				// libav* 52.20.0 fix
-				if ((d = avcodec_decode_audio3(cctx, frame, &n, &packet)) > 0 && n) {
-				//if ((d = avcodec_decode_audio2(cctx, frame, &n, packet.data, packet.size)) > 0 && n) {
-					int16_t buf[AVCODEC_MAX_AUDIO_FRAME_SIZE / sizeof(int16_t)];
+			i++;
 
-					int s;
-					if ((s = audio_resample(sctx, buf, frame, n / (sizeof(int16_t) * cctx->channels))) > 0) {
-						_frames = realloc(_frames, (_n + s) * sizeof(int16_t));
-						memcpy(_frames + _n, buf, s * sizeof(int16_t));
-						_n += s;
-					}
-				}
+			continue;
+		}
 
-				av_free(frame);
+		if (d->pcm_off) {
+			memmove(d->pcm, d->pcm + d->pcm_off, avail * sizeof(int16_t));
+			d->pcm_len = avail;
+			d->pcm_off = 0;
+		}
 
-				if (d <= 0) break;
+		if (sound_decoder_decode(d) <= 0) {
+			if (avail && !d->skip) {
+				memcpy(frames[i], d->pcm, avail * sizeof(int16_t));
+				memset(frames[i] + avail, 0, (FRAME_SIZE - avail) * sizeof(int16_t));
 
-				data += d;
-				size -= d; 
+				d->pcm_off = d->pcm_len;
 
-				j++; 
+				i++;
 			}
 
-			if (j > 1) console_debug(_CLASS, "ffmpeg", "decoded %i frame from packet\n", j);
+			d->left = 0;
+		}
+	}
+
+	return i;
+}
+
+/* the most frames a single cache entry may hold */
+static int64_t sound_pipeline_record_max(struct sound_pipeline *pl) {
+	return pl->cache->budget / SOUNDCACHE_PCM_ENTRY_SHARE / sizeof(audio_frame);
+}
+
+/* a cached input is used as is, anything else is decoded and kept if it was decoded completely */
+static int sound_pipeline_open(struct sound_pipeline *pl) {
+	struct input *input = pl->input;
 
-			packet.data = _data;
-			packet.size = _size;
+	if (pl->cache && pl->has_id && (pl->pcm = soundcache_pcm_get(pl->cache, &pl->id))) {
+		pl->pos = 0;
+		pl->end = pl->pcm->n;
+
+		if (input->from >= 0 && input->to >= 0) {
+			pl->pos = min((int) (input->from * FRAMES_PER_SECOND), pl->pcm->n);
+			pl->end = min(pl->pos + (int) ((input->to - input->from) * FRAMES_PER_SECOND), pl->pcm->n);
+			if (pl->end < pl->pos) pl->end = pl->pos;
 		}
 
-		av_free_packet(&packet);
+		/* ffmpeg never gets to take over the buffer */
+		if (input->type == SOUND_INPUT_TYPE_BUFFER) free(input->buffer.data);
+
+		return 0;
 	}
 
-	audio_resample_close(sctx);
+	if (sound_decoder_open(&pl->decoder, input)) return -1;
+
+	pl->open = TRUE;
+
+	pl->recording = pl->cache && pl->has_id && !(input->from >= 0 && input->to >= 0);
+
+	/* inputs known to be too long are not even started on */
+	AVStream *audio = pl->decoder.audio;
+	if (pl->recording && audio->duration != AV_NOPTS_VALUE) {
+		AVRational frames = { 1, FRAMES_PER_SECOND };
+
+		if (av_rescale_q(audio->duration, audio->time_base, frames) > sound_pipeline_record_max(pl)) pl->recording = FALSE;
+	}
+
+	return 0;
+}
+
+static int sound_pipeline_read_cached(struct sound_pipeline *pl, audio_frame *frames, int n) {
+	if (n > pl->end - pl->pos) n = pl->end - pl->pos;
+
+	memcpy(frames, pl->pcm->frame + pl->pos, n * sizeof(audio_frame));
+
+	pl->pos += n;
+
+	return n;
+}
 
-	avcodec_close(cctx);
+/* keeps the decoded frames for the cache, giving up once they outgrow a single entry's share of it */
+static void sound_pipeline_record(struct sound_pipeline *pl, audio_frame *frames, int n) {
+	if (pl->recorded + n > pl->record_size) {
+		int size = pl->record_size ? pl->record_size * 2 : 1024;
+		if (size > sound_pipeline_record_max(pl)) size = sound_pipeline_record_max(pl);
 
-	sound_av_input_close(&in);
+		if (pl->recorded + n > size) {
+			free(pl->record);
+			pl->record = NULL;
 
-	int r = ceil((double) _n / FRAME_SIZE);
+			pl->recording = FALSE;
 
-	if (r) {
-		*frames = calloc(r, sizeof(audio_frame));
+			return;
+		}
 
-		memcpy(*frames, _frames, _n * sizeof(int16_t));
+		pl->record = realloc(pl->record, size * sizeof(audio_frame));
+		pl->record_size = size;
 	}
 
-	if (_frames) free(_frames);
+	memcpy(pl->record + pl->recorded, frames, n * sizeof(audio_frame));
 
-	return r;
+	pl->recorded += n;
 }
 
-static int sound_extract_target_frames(audio_frame **frames, int n, float from, float to) {
-	int len = (int) ((to - from) * FRAMES_PER_SECOND);
+static void * sound_pipeline_decode(void *arg) {
+	struct sound_pipeline *pl = (struct sound_pipeline *) arg;
 
-	if (len <= 0 || (int) (from * FRAMES_PER_SECOND) > n || (int) (to * FRAMES_PER_SECOND) > n) return -1;
+	if (sound_pipeline_open(pl)) {
+		pthread_mutex_lock(&pl->m_pipeline);
 
-	audio_frame *_frames = *frames;
+		pl->eof = TRUE;
 
-	*frames = malloc(len * sizeof(audio_frame));
-	memcpy(*frames, _frames + (int) (from * FRAMES_PER_SECOND), len * sizeof(audio_frame));
-	
-	free(_frames);
+		pthread_cond_broadcast(&pl->notify);
+		pthread_mutex_unlock(&pl->m_pipeline);
+
+		return NULL;
+	}
+
+	audio_frame chunk[SOUND_PIPELINE_CHUNK];
+
+	while (TRUE) {
+		pthread_mutex_lock(&pl->m_pipeline);
+
+		while (!pl->stop && pl->n > SOUND_PIPELINE_FRAMES - SOUND_PIPELINE_CHUNK) {
+			pthread_cond_wait(&pl->notify, &pl->m_pipeline);
+		}
+
+		if (pl->stop) {
+			pthread_mutex_unlock(&pl->m_pipeline);
+
+			break;
+		}
+
+		pthread_mutex_unlock(&pl->m_pipeline);
+
+		/* decoding happens outside the lock, the ring only ever grows from here */
+		int r;
+		if (pl->pcm) {
+			r = sound_pipeline_read_cached(pl, chunk, SOUND_PIPELINE_CHUNK);
+		} else {
+			r = sound_decoder_read(&pl->decoder, chunk, SOUND_PIPELINE_CHUNK);
+
+			if (pl->recording) sound_pipeline_record(pl, chunk, r);
+		}
+
+		pthread_mutex_lock(&pl->m_pipeline);
+
+		int i;
+		for (i = 0; i < r; i++) {
+			memcpy(pl->frame[(pl->head + pl->n + i) % SOUND_PIPELINE_FRAMES], chunk[i], sizeof(audio_frame));
+		}
+
+		pl->n += r;
+
+		if (r < SOUND_PIPELINE_CHUNK) pl->eof = TRUE;
+
+		pthread_cond_broadcast(&pl->notify);
+		pthread_mutex_unlock(&pl->m_pipeline);
+
+		if (r < SOUND_PIPELINE_CHUNK) {
+			if (pl->recording && pl->recorded) {
+				soundcache_pcm_insert(pl->cache, &pl->id, pl->record, pl->recorded);
+				pl->record = NULL;
+			}
+
+			break;
+		}
+	}
 
-	return len;
+	return NULL;
+}
+
+/*
+ * starts decoding input ahead into a bounded ring of frames; with a cache and
+ * the id of the input, decoding is skipped for inputs decoded before; buffer
+ * data is taken over unless starting fails
+ */
+static struct sound_pipeline * sound_pipeline_new(struct input *input, struct soundcache_pcm_cache *cache, const struct soundcache_id *id) {
+	struct sound_pipeline *pl = malloc(sizeof(struct sound_pipeline));
+
+	pl->input = input;
+	pl->head = 0;
+	pl->n = 0;
+	pl->eof = FALSE;
+	pl->stop = FALSE;
+	pl->open = FALSE;
+	pl->cache = cache;
+	pl->has_id = (id != NULL);
+	if (id) soundcache_id_copy(&pl->id, id);
+	pl->pcm = NULL;
+	pl->recording = FALSE;
+	pl->record = NULL;
+	pl->recorded = 0;
+	pl->record_size = 0;
+	pthread_mutex_init(&pl->m_pipeline, NULL);
+	pthread_cond_init(&pl->notify, NULL);
+
+	if (pthread_create(&pl->tid, NULL, sound_pipeline_decode, pl)) {
+		console_error(_CLASS, "ffmpeg", "failed to create decoder thread\n");
+
+		if (pl->has_id) soundcache_id_free(&pl->id);
+
+		pthread_cond_destroy(&pl->notify);
+		pthread_mutex_destroy(&pl->m_pipeline);
+
+		free(pl);
+
+		return NULL;
+	}
+
+	return pl;
+}
+
+/*
+ * blocks until n frames are decoded or the input ends and returns the number
+ * of frames taken, last is set once nothing more will follow
+ */
+static int sound_pipeline_read(struct sound_pipeline *pl, audio_frame *frames, int n, bool *last) {
+	pthread_mutex_lock(&pl->m_pipeline);
+
+	while (pl->n < n && !pl->eof) {
+		pthread_cond_wait(&pl->notify, &pl->m_pipeline);
+	}
+
+	if (n > pl->n) n = pl->n;
+
+	int i;
+	for (i = 0; i < n; i++) {
+		memcpy(frames[i], pl->frame[pl->head], sizeof(audio_frame));
+		pl->head = (pl->head + 1) % SOUND_PIPELINE_FRAMES;
+	}
+
+	pl->n -= n;
+
+	*last = pl->eof && !pl->n;
+
+	pthread_cond_broadcast(&pl->notify);
+	pthread_mutex_unlock(&pl->m_pipeline);
+
+	return n;
+}
+
+static void sound_pipeline_free(struct sound_pipeline *pl) {
+	pthread_mutex_lock(&pl->m_pipeline);
+
+	pl->stop = TRUE;
+
+	pthread_cond_broadcast(&pl->notify);
+	pthread_mutex_unlock(&pl->m_pipeline);
+
+	pthread_join(pl->tid, NULL);
+
+	if (pl->open) sound_decoder_close(&pl->decoder);
+
+	if (pl->pcm) soundcache_pcm_put(pl->cache, pl->pcm);
+
+	if (pl->record) free(pl->record);
+
+	if (pl->has_id) soundcache_id_free(&pl->id);
+
+	pthread_cond_destroy(&pl->notify);
+	pthread_mutex_destroy(&pl->m_pipeline);
+
+	free(pl);
+}
+
+/* the conditions that decide how a clip encodes, besides the range played */
+static void playback_cache_key(struct client *c, struct soundcache_key *key) {
+	int use = -1;
+	key->codec_version = client_get_celt_codec_version(c, &use);
+	key->bitrate = connection_get_bitrate(c->con);
+	key->frames = connection_get_frames(c->con);
+	key->volume = c->env->sound.playback.volume;
+}
+
+static bool playback_cache_matches(struct client *c, struct soundcache_key *key) {
+	struct soundcache_key now;
+	playback_cache_key(c, &now);
+
+	return now.codec_version == key->codec_version && now.bitrate == key->bitrate && now.frames == key->frames && now.volume == key->volume;
+}
+
+/* identifies the input for the caches, which has to happen before decoding takes over buffer data */
+static void playback_input_init(struct client *c, struct playback_input *pi, struct input *input) {
+	pi->input = input;
+	pi->has_id = !soundcache_id_init(&pi->id, input);
+	pi->pipeline = NULL;
+}
+
+static bool playback_input_start(struct client *c, struct playback_input *pi) {
+	pi->pipeline = sound_pipeline_new(pi->input, c->env->sound.playback.pcm, pi->has_id ? &pi->id : NULL);
+
+	return pi->pipeline != NULL;
+}
+
+/* the input has to be off the queue already */
+static void playback_input_free(struct playback_input *pi) {
+	if (pi->pipeline) {
+		sound_pipeline_free(pi->pipeline);
+	} else if (pi->input->type == SOUND_INPUT_TYPE_BUFFER) {
+		free(pi->input->buffer.data);
+	}
+
+	if (pi->has_id) soundcache_id_free(&pi->id);
+
+	if (pi->input->type == SOUND_INPUT_TYPE_FILE) {
+		free(pi->input->file);
+	} else if (pi->input->type == SOUND_INPUT_TYPE_BUFFER) {
+		free(pi->input->buffer.name);
+	}
+
+	free(pi->input);
+}
+
+/*
+ * starts decoding the input queued after the current one, so that it is
+ * ready to go once the current one ends
+ */
+static void playback_prefetch(struct client *c, struct playback_input *next, bool *prefetched) {
+	if (*prefetched) return;
+
+	struct playback *pb = &c->env->sound.playback;
+
+	/* runs once per packet, so an empty queue is only looked at again once something got queued */
+	if (pb->prefetch_empty && __atomic_load_n(&pb->generation, __ATOMIC_ACQUIRE) == pb->prefetch_generation) return;
+
+	struct input *input = NULL;
+
+	pthread_mutex_lock(&c->env->sound.m_playback);
+
+	struct list_head *l = pb->current->l_input.next;
+	if (l != &pb->input) {
+		input = list_entry(l, struct input, l_input);
+
+		pb->prefetch = input;
+	} else {
+		pb->prefetch_empty = TRUE;
+		pb->prefetch_generation = pb->generation;
+	}
+
+	pthread_mutex_unlock(&c->env->sound.m_playback);
+
+	if (!input) return;
+
+	/* if the input gets cleared meanwhile, it is left to this thread to free */
+	playback_input_init(c, next, input);
+	playback_input_start(c, next);
+
+	*prefetched = TRUE;
+}
+
+/* replays the packets of an earlier playback, leaving only serialization and encryption */
+static void playback_cached(struct client *c, struct soundcache_clip *clip, struct playback_input *next, bool *prefetched) {
+	struct timer t = TIMER_INIT;
+
+	uint64_t seq;
+	int i;
+	for (i = 0, seq = 0; i < clip->n && c->env->sound.playback.enabled && !c->env->sound.playback.next; seq += clip->packet[i].frames, i++) {
+		struct packet p;
+
+		struct audio audio[AUDIO_MAX_FRAMES + 1];
+
+		soundcache_clip_get(clip, i, &p, audio);
+
+		p.target = UDP_TARGET_NORMAL;
+
+		p.payload.sequence = seq;
+
+		p.payload.has_positional_audio = FALSE;
+
+		audio_send(c->con, &p);
+
+		playback_prefetch(c, next, prefetched);
+
+		while (!timer_is_elapsed(&t, clip->packet[i].frames * 10 * 1000)) {
+			msleep(1);
+		}
+	}
 }
 
 static void * playback(void *arg) {
 	struct client *c = (struct client *) arg;
 
+	struct playback_input cur, next;
+	bool prefetched = FALSE;
+
 	pthread_mutex_lock(&c->env->sound.m_playback);
 
 	idle:
+	/* a prefetched input that got cleared from the queue */
+	if (prefetched && c->env->sound.playback.prefetch != next.input) {
+		playback_input_free(&next);
+
+		prefetched = FALSE;
+	}
+
 	if (list_empty(&c->env->sound.playback.input)) {
 		pthread_cond_wait(&c->env->sound.playback.notify, &c->env->sound.m_playback);
 
@@ -500,6 +1029,18 @@ static void * playback(void *arg) {
 
 	c->env->sound.playback.current = input;
 
+	/* inputs are only ever appended, so one still queued is the head by now */
+	if (prefetched && input == next.input) {
+		cur = next;
+	} else {
+		cur.input = NULL;
+	}
+
+	prefetched = FALSE;
+
+	c->env->sound.playback.prefetch = NULL;
+	c->env->sound.playback.prefetch_empty = FALSE;
+
 	pthread_mutex_unlock(&c->env->sound.m_playback);
 
 	if (!input) {
@@ -508,6 +1049,8 @@ static void * playback(void *arg) {
 		goto idle;
 	}
 
+	if (!cur.input) playback_input_init(c, &cur, input);
+
 	if (input->plugin) {
 		task_new_arg(a, l);
 		task_push_arg(a, l, char *, strdup(input->type == SOUND_INPUT_TYPE_FILE ? input->file : input->buffer.name));
@@ -517,81 +1060,128 @@ static void * playback(void *arg) {
 
 	c->env->sound.playback.next = FALSE;
 
-	int n;
-	audio_frame *frames;
+	/* the packets are recorded while playing and only kept if nothing changed on the way */
+	struct soundcache_clip *clip = NULL;
 
-	if (input->type == SOUND_INPUT_TYPE_FILE) {
-		if ((n = sound_extract_raw_audio(input->file, SOUND_INPUT_TYPE_FILE, &frames)) <= 0) goto exit;
-	} else if (input->type == SOUND_INPUT_TYPE_BUFFER) {
-		if ((n = sound_extract_raw_audio(input->buffer.name, SOUND_INPUT_TYPE_BUFFER, &frames, input->buffer.data, input->buffer.len)) <= 0) goto exit;
-	} else {
-		goto exit;
-	}
+	if (cur.has_id) {
+		struct soundcache_key key;
 
-	if (input->from >= 0 && input->to >= 0) {
-		if ((n = sound_extract_target_frames(&frames, n, input->from, input->to)) < 0) {
-			free(frames);
+		key.from = input->from;
+		key.to = input->to;
+
+		playback_cache_key(c, &key);
+
+		soundcache_id_copy(&key.id, &cur.id);
+
+		struct soundcache_clip *cached;
+		if ((cached = soundcache_lookup(c->env->sound.playback.cache, &key))) {
+			soundcache_id_free(&key.id);
+
+			playback_cached(c, cached, &next, &prefetched);
 
 			goto exit;
 		}
+
+		clip = soundcache_clip_new(&key);
 	}
 
+	if (!cur.pipeline && !playback_input_start(c, &cur)) goto exit;
+
+	struct sound_pipeline *pl = cur.pipeline;
+
 	struct timer t = TIMER_INIT;
 
 	uint64_t seq;
 	int s;
-	int i;
-	for (i = 0, seq = 0, s = connection_get_frames(c->con); n && c->env->sound.playback.enabled && !c->env->sound.playback.next; n -= s, i += s, seq += s, s = connection_get_frames(c->con)) {
-		if (s > n) s = n;
+	bool last = FALSE;
+	for (seq = 0; !last && c->env->sound.playback.enabled && !c->env->sound.playback.next; seq += s) {
+		s = connection_get_frames(c->con);
+
+		audio_frame frames[s];
+
+		if (!(s = sound_pipeline_read(pl, frames, s, &last))) break;
 
 		int use;
 		if ((use = sound_update_celt_encoder(c, &c->env->sound.playback.cc, &c->env->sound.playback.cencoder)) < 0) break;
 
+		if (clip && !playback_cache_matches(c, &clip->key)) {
+			soundcache_clip_free(clip);
+			clip = NULL;
+		}
+
 		struct packet p;
 
-		p.type = (use == CELT_ALPHA) ? UDP_TYPE_CELT_ALPHA : UDP_TYPE_CELT_BETA;
+		struct audio audio[s + 1];
+
+		opus_buffer opus;
+
+		audio[0].data = opus;
+
+		p.type = sound_packet_type(use);
 
 		p.target = UDP_TARGET_NORMAL;
 
+		p.payload.audio = audio;
+
 		p.payload.sequence = seq;
 
-		sound_adjust_volume(&frames[i], s, c->env->sound.playback.volume);
+		sound_adjust_volume(frames, s, c->env->sound.playback.volume);
 
-		if (audio_celt_encode(c->con, c->env->sound.playback.cc, c->env->sound.playback.cencoder, &p, &frames[i], s, (n - s == 0)) >= 0) {
+		if (audio_celt_encode(c->con, c->env->sound.playback.cc, c->env->sound.playback.cencoder, &p, frames, s, last) >= 0) {
 			p.payload.has_positional_audio = FALSE;
 
 			audio_send(c->con, &p);
 
-			free(p.payload.audio);
+			if (clip && !soundcache_clip_append(clip, &p, s)) {
+				soundcache_clip_free(clip);
+				clip = NULL;
+			}
+
+			if (clip && last) {
+				soundcache_insert(c->env->sound.playback.cache, clip);
+				clip = NULL;
+			}
+		} else if (clip) {
+			soundcache_clip_free(clip);
+			clip = NULL;
 		}
 
+		playback_prefetch(c, &next, &prefetched);
+
 		while (!timer_is_elapsed(&t, s * 10 * 1000)) {
 			msleep(1);
 		}
 	}
 
-	free(frames);
-
 	exit:
-	//if (c->env->sound.playback.cencoder) c->env->sound.playback.cc->encoder_destroy(c->env->sound.playback.cencoder);
+	if (clip) soundcache_clip_free(clip);
 
-	if (input->type == SOUND_INPUT_TYPE_FILE) {
-		free(input->file);
-	} else if (input->type == SOUND_INPUT_TYPE_BUFFER) {
-		free(input->buffer.name);
-	}
+	//if (c->env->sound.playback.cencoder) c->env->sound.playback.cc->encoder_destroy(c->env->sound.playback.cencoder);
 
 	pthread_mutex_lock(&c->env->sound.m_playback);
 
 	list_del(&input->l_input);
-	free(input);
 
 	c->env->sound.playback.current = NULL;
 
+	pthread_mutex_unlock(&c->env->sound.m_playback);
+
+	playback_input_free(&cur);
+
+	pthread_mutex_lock(&c->env->sound.m_playback);
+
 	if (c->env->sound.playback.enabled) goto idle;
 
+	if (prefetched) {
+		if (c->env->sound.playback.prefetch == next.input) list_del(&next.input->l_input);
+
+		c->env->sound.playback.prefetch = NULL;
+	}
+
 	pthread_mutex_unlock(&c->env->sound.m_playback);
 
+	if (prefetched) playback_input_free(&next);
+
 	pthread_exit(NULL);
 }
 
@@ -625,6 +1215,8 @@ void sound_start_playback_from_file(struct client *c, const char *file, float fr
 
 	list_add_tail(&input->l_input, &c->env->sound.playback.input);
 
+	__atomic_add_fetch(&c->env->sound.playback.generation, 1, __ATOMIC_RELEASE);
+
 	pthread_cond_signal(&c->env->sound.playback.notify);
 
 	pthread_mutex_unlock(&c->env->sound.m_playback);
@@ -690,6 +1282,8 @@ void sound_start_playback_from_buffer(struct client *c, const char *name, unsign
 
 	list_add_tail(&input->l_input, &c->env->sound.playback.input);
 
+	__atomic_add_fetch(&c->env->sound.playback.generation, 1, __ATOMIC_RELEASE);
+
 	pthread_cond_signal(&c->env->sound.playback.notify);
 
 	pthread_mutex_unlock(&c->env->sound.m_playback);
@@ -749,10 +1343,18 @@ void sound_clear_playback(struct client *c) {
 
 	struct input *i, *_i;
 	list_for_each_entry_safe(i, _i, &c->env->sound.playback.input, l_input) {
-		if (i != c->env->sound.playback.current) {
-			list_del(&i->l_input);
-			free(i);
+		if (i == c->env->sound.playback.current) continue;
+
+		list_del(&i->l_input);
+
+		/* already being decoded, the playback thread frees it once it notices */
+		if (i == c->env->sound.playback.prefetch) {
+			c->env->sound.playback.prefetch = NULL;
+
+			continue;
 		}
+
+		free(i);
 	}
 
 	pthread_mutex_unlock(&c->env->sound.m_playback);
@@ -829,7 +1431,7 @@ static void stream_reset_track(struct stream *s, struct track *track) {
 	pthread_mutex_unlock(&s->m_buffer);
 }
 
-static void sound_mix_frame(audio_frame a, audio_frame b, audio_frame c) {
+void sound_mix_frame(audio_frame a, audio_frame b, audio_frame c) {
 	int i;
 	for (i = 0; i < FRAME_SIZE; i++) {
 		int s = ((int) a[i] + (int) b[i]) / (a[i] ? 2 : 1);
@@ -917,10 +1519,18 @@ static void * stream(void *arg) {
 
 		struct packet p;
 
-		p.type = (use == CELT_ALPHA) ? UDP_TYPE_CELT_ALPHA : UDP_TYPE_CELT_BETA;
+		struct audio audio[s + 1];
+
+		opus_buffer opus;
+
+		audio[0].data = opus;
+
+		p.type = sound_packet_type(use);
 
 		p.target = UDP_TARGET_WHISPER_CHANNEL;
 
+		p.payload.audio = audio;
+
 		p.payload.sequence = seq;
 
 		sound_adjust_volume(frames, s, c->env->sound.stream.volume);
@@ -930,8 +1540,6 @@ static void * stream(void *arg) {
 			p.payload.has_positional_audio = FALSE;
 
 			audio_send(c->con, &p);
-
-			free(p.payload.audio);
 		}
 
 		seq += s;
@@ -1063,6 +1671,9 @@ void api_on_audio_message(struct client *c, struct packet *pkt) {
 
 	if (pkt->type == UDP_TYPE_SPEEX) return;
 
+	/* without libopus there is nothing to decode these with */
+	if (pkt->type == UDP_TYPE_OPUS && !celtcodec_get(OPUS_BITSTREAM_VERSION)) return;
+
 	if (c->env->sound.stream.enabled) {
 		audio_frame *frames;
 
@@ -1081,7 +1692,11 @@ void api_on_audio_message(struct client *c, struct packet *pkt) {
 			stream_reset_track(&c->env->sound.stream, track);
 		}
 
-		if (!sound_update_celt_decoder(c, pkt->type, &track->cc, &track->cdecoder)) return;
+		if (!sound_update_celt_decoder(c, pkt->type, &track->cc, &track->cdecoder)) {
+			pthread_mutex_unlock(&c->env->sound.stream.buffer.m_track);
+
+			return;
+		}
 
 		int s = audio_celt_decode(c->con, track->cc, track->cdecoder, pkt, &frames);
 
@@ -12,6 +12,7 @@
 #include "channel.h"
 #include "../plugin.h"
 #include "../list.h"
+#include "soundcache.h"
 #include "../timer.h"
 #include "../types.h"
 
@@ -84,12 +85,76 @@ struct input {
 	struct list_head l_input;
 };
 
+/* 320 ms of audio decoded ahead of the encoder */
+#define SOUND_PIPELINE_FRAMES 32
+
+#define SOUND_PIPELINE_CHUNK 4
+
+struct sound_decoder {
+	struct av_input in;
+	AVStream *audio;
+	AVCodecContext *cctx;
+	ReSampleContext *sctx;
+	AVPacket packet;
+	bool has_packet;
+	uint8_t *data;
+	int size;
+	int16_t *frame;
+	int16_t *pcm;
+	int pcm_size;
+	int pcm_len;
+	int pcm_off;
+	int64_t skip;
+	int64_t left;
+	int64_t target;
+	bool seek;
+};
+
+struct sound_pipeline {
+	struct input *input;
+	struct sound_decoder decoder;
+	bool open;
+	struct soundcache_pcm_cache *cache;
+	struct soundcache_id id;
+	bool has_id;
+	struct soundcache_pcm *pcm;
+	int pos;
+	int end;
+	bool recording;
+	audio_frame *record;
+	int recorded;
+	int record_size;
+	audio_frame frame[SOUND_PIPELINE_FRAMES];
+	int head;
+	int n;
+	bool eof;
+	bool stop;
+	pthread_mutex_t m_pipeline;
+	pthread_cond_t notify;
+	pthread_t tid;
+};
+
+/* an input together with everything decoding it needs, possibly set up ahead of its turn */
+struct playback_input {
+	struct input *input;
+	struct soundcache_id id;
+	bool has_id;
+	struct sound_pipeline *pipeline;
+};
+
 struct playback {
 	struct celtcodec *cc;
 	CELTEncoder *cencoder;
 	bool enabled;
 	struct list_head input;
 	struct input *current;
+	struct input *prefetch;
+	/* bumped whenever an input is queued, lets the playback thread tell if looking for one to prefetch is worth the lock */
+	uint32_t generation;
+	bool prefetch_empty;
+	uint32_t prefetch_generation;
+	struct soundcache *cache;
+	struct soundcache_pcm_cache *pcm;
 	float volume;
 	bool next;
 	pthread_t tid;
@@ -105,6 +170,10 @@ struct sound {
 
 void sound_av_init();
 
+void sound_adjust_volume(audio_frame *, int, float);
+
+void sound_mix_frame(audio_frame, audio_frame, audio_frame);
+
 void sound_start_playback(struct environment *);
 
 void sound_start_playback_from_file(struct client *, const char *, float, float, float);
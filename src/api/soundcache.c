@@ -0,0 +1,368 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "../console.h"
+#include "../list.h"
+#include "sound.h"
+#include "soundcache.h"
+#include "../types.h"
+
+#define _CLASS "soundcache"
+
+/* FNV-1a, buffers are only hashed once per playback */
+static uint64_t soundcache_hash(const unsigned char *data, int len) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	int i;
+	for (i = 0; i < len; i++) {
+		h ^= data[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+/* has to run before the input is handed to the decoder, which takes over buffer data */
+int soundcache_id_init(struct soundcache_id *id, struct input *input) {
+	id->type = input->type;
+	id->mtime = 0;
+	id->size = 0;
+	id->hash = 0;
+
+	if (input->type == SOUND_INPUT_TYPE_FILE) {
+		struct stat st;
+		if (stat(input->file, &st)) return -1;
+
+		id->name = strdup(input->file);
+		id->mtime = st.st_mtime;
+		id->size = st.st_size;
+	} else if (input->type == SOUND_INPUT_TYPE_BUFFER) {
+		id->name = strdup(input->buffer.name);
+		id->size = input->buffer.len;
+		id->hash = soundcache_hash(input->buffer.data, input->buffer.len);
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+void soundcache_id_copy(struct soundcache_id *dst, const struct soundcache_id *src) {
+	*dst = *src;
+	dst->name = strdup(src->name);
+}
+
+void soundcache_id_free(struct soundcache_id *id) {
+	free(id->name);
+}
+
+bool soundcache_id_equal(const struct soundcache_id *a, const struct soundcache_id *b) {
+	return a->type == b->type && a->mtime == b->mtime && a->size == b->size && a->hash == b->hash && !strcmp(a->name, b->name);
+}
+
+static bool soundcache_key_equal(const struct soundcache_key *a, const struct soundcache_key *b) {
+	return a->from == b->from && a->to == b->to && a->volume == b->volume && a->codec_version == b->codec_version && a->bitrate == b->bitrate && a->frames == b->frames && soundcache_id_equal(&a->id, &b->id);
+}
+
+static size_t soundcache_clip_size(struct soundcache_clip *clip) {
+	return sizeof(struct soundcache_clip) + clip->size * sizeof(struct soundcache_packet) + clip->data_size;
+}
+
+struct soundcache * soundcache_new(size_t budget) {
+	struct soundcache *cache = malloc(sizeof(struct soundcache));
+
+	INIT_LIST_HEAD(&cache->clips);
+	cache->size = 0;
+	cache->budget = budget;
+	cache->hits = 0;
+	cache->misses = 0;
+
+	return cache;
+}
+
+void soundcache_free(struct soundcache *cache) {
+	console_debug(_CLASS, _NONE, "%u hits, %u misses, %zu bytes of encoded audio\n", cache->hits, cache->misses, cache->size);
+
+	struct soundcache_clip *clip, *_clip;
+	list_for_each_entry_safe(clip, _clip, &cache->clips, l_clips) {
+		list_del(&clip->l_clips);
+		soundcache_clip_free(clip);
+	}
+
+	free(cache);
+}
+
+struct soundcache_clip * soundcache_lookup(struct soundcache *cache, const struct soundcache_key *key) {
+	struct soundcache_clip *clip;
+	list_for_each_entry(clip, &cache->clips, l_clips) {
+		if (soundcache_key_equal(&clip->key, key)) {
+			list_move(&clip->l_clips, &cache->clips);
+
+			cache->hits++;
+
+			return clip;
+		}
+	}
+
+	cache->misses++;
+
+	return NULL;
+}
+
+/* takes over the clip and evicts the least recently played ones until it fits */
+void soundcache_insert(struct soundcache *cache, struct soundcache_clip *clip) {
+	size_t size = soundcache_clip_size(clip);
+
+	if (size > cache->budget) {
+		soundcache_clip_free(clip);
+
+		return;
+	}
+
+	while (cache->size + size > cache->budget) {
+		struct soundcache_clip *lru = list_entry(cache->clips.prev, struct soundcache_clip, l_clips);
+
+		list_del(&lru->l_clips);
+
+		cache->size -= soundcache_clip_size(lru);
+
+		soundcache_clip_free(lru);
+	}
+
+	list_add(&clip->l_clips, &cache->clips);
+
+	cache->size += size;
+}
+
+/* takes over the id of key */
+struct soundcache_clip * soundcache_clip_new(const struct soundcache_key *key) {
+	struct soundcache_clip *clip = malloc(sizeof(struct soundcache_clip));
+
+	clip->key = *key;
+
+	clip->packet = NULL;
+	clip->n = 0;
+	clip->size = 0;
+
+	clip->data = NULL;
+	clip->len = 0;
+	clip->data_size = 0;
+
+	return clip;
+}
+
+void soundcache_clip_free(struct soundcache_clip *clip) {
+	soundcache_id_free(&clip->key.id);
+
+	if (clip->packet) free(clip->packet);
+	if (clip->data) free(clip->data);
+
+	free(clip);
+}
+
+/* records an encoded packet covering frames audio frames, fails once the clip grows too large */
+bool soundcache_clip_append(struct soundcache_clip *clip, struct packet *p, int frames) {
+	struct soundcache_packet cp;
+
+	cp.type = p->type;
+	cp.frames = frames;
+	cp.term = 0;
+	cp.off = clip->len;
+
+	/* same framing as audio_serialize: a single Opus entry, otherwise up to the first one without term */
+	int i;
+	size_t len = 0;
+	for (i = 0; i <= AUDIO_MAX_FRAMES; i++) {
+		struct audio *a = &p->payload.audio[i];
+
+		cp.len[i] = a->len;
+		if (a->term) cp.term |= 1 << i;
+
+		len += a->len;
+
+		if (p->type == UDP_TYPE_OPUS || !a->term) break;
+	}
+
+	if (i > AUDIO_MAX_FRAMES) return FALSE;
+
+	cp.n = i + 1;
+
+	if (clip->len + len > SOUNDCACHE_CLIP_MAX_SIZE) return FALSE;
+
+	if (clip->len + len > clip->data_size) {
+		clip->data_size = clip->data_size ? clip->data_size * 2 : 4096;
+		if (clip->data_size < clip->len + len) clip->data_size = clip->len + len;
+
+		clip->data = realloc(clip->data, clip->data_size);
+	}
+
+	for (i = 0; i < cp.n; i++) {
+		memcpy(clip->data + clip->len, p->payload.audio[i].data, cp.len[i]);
+		clip->len += cp.len[i];
+	}
+
+	if (clip->n == clip->size) {
+		clip->size = clip->size ? clip->size * 2 : 64;
+		clip->packet = realloc(clip->packet, clip->size * sizeof(struct soundcache_packet));
+	}
+
+	clip->packet[clip->n++] = cp;
+
+	return TRUE;
+}
+
+/* audio has to provide room for AUDIO_MAX_FRAMES + 1 entries, which end up pointing into the clip */
+void soundcache_clip_get(struct soundcache_clip *clip, int n, struct packet *p, struct audio *audio) {
+	struct soundcache_packet *cp = &clip->packet[n];
+
+	p->type = cp->type;
+	p->payload.audio = audio;
+
+	unsigned char *data = clip->data + cp->off;
+
+	int i;
+	for (i = 0; i < cp->n; i++) {
+		audio[i].term = (cp->term >> i) & 1;
+		audio[i].len = cp->len[i];
+		audio[i].data = data;
+
+		data += cp->len[i];
+	}
+}
+
+static size_t soundcache_pcm_size(int n) {
+	return sizeof(struct soundcache_pcm) + n * sizeof(audio_frame);
+}
+
+static void soundcache_pcm_free(struct soundcache_pcm *pcm) {
+	soundcache_id_free(&pcm->id);
+
+	free(pcm->frame);
+	free(pcm);
+}
+
+struct soundcache_pcm_cache * soundcache_pcm_cache_new(size_t budget) {
+	struct soundcache_pcm_cache *cache = malloc(sizeof(struct soundcache_pcm_cache));
+
+	INIT_LIST_HEAD(&cache->pcm);
+	cache->size = 0;
+	cache->budget = budget;
+	cache->hits = 0;
+	cache->misses = 0;
+	pthread_mutex_init(&cache->m_pcm, NULL);
+
+	return cache;
+}
+
+/* every entry handed out has to be put back before */
+void soundcache_pcm_cache_free(struct soundcache_pcm_cache *cache) {
+	console_debug(_CLASS, _NONE, "%u hits, %u misses, %zu bytes of decoded audio\n", cache->hits, cache->misses, cache->size);
+
+	struct soundcache_pcm *pcm, *_pcm;
+	list_for_each_entry_safe(pcm, _pcm, &cache->pcm, l_pcm) {
+		list_del(&pcm->l_pcm);
+		soundcache_pcm_free(pcm);
+	}
+
+	pthread_mutex_destroy(&cache->m_pcm);
+
+	free(cache);
+}
+
+/* the entry stays valid until it is put back, even if it gets evicted meanwhile */
+struct soundcache_pcm * soundcache_pcm_get(struct soundcache_pcm_cache *cache, const struct soundcache_id *id) {
+	pthread_mutex_lock(&cache->m_pcm);
+
+	struct soundcache_pcm *pcm;
+	list_for_each_entry(pcm, &cache->pcm, l_pcm) {
+		if (soundcache_id_equal(&pcm->id, id)) {
+			list_move(&pcm->l_pcm, &cache->pcm);
+
+			pcm->refs++;
+
+			cache->hits++;
+
+			pthread_mutex_unlock(&cache->m_pcm);
+
+			return pcm;
+		}
+	}
+
+	cache->misses++;
+
+	pthread_mutex_unlock(&cache->m_pcm);
+
+	return NULL;
+}
+
+void soundcache_pcm_put(struct soundcache_pcm_cache *cache, struct soundcache_pcm *pcm) {
+	pthread_mutex_lock(&cache->m_pcm);
+
+	bool release = !--pcm->refs && pcm->evicted;
+
+	pthread_mutex_unlock(&cache->m_pcm);
+
+	if (release) soundcache_pcm_free(pcm);
+}
+
+/* takes over frames and evicts the least recently used entries until they fit */
+void soundcache_pcm_insert(struct soundcache_pcm_cache *cache, const struct soundcache_id *id, audio_frame *frames, int n) {
+	size_t size = soundcache_pcm_size(n);
+
+	if (size > cache->budget) {
+		free(frames);
+
+		return;
+	}
+
+	struct soundcache_pcm *pcm = malloc(sizeof(struct soundcache_pcm));
+
+	soundcache_id_copy(&pcm->id, id);
+	pcm->frame = frames;
+	pcm->n = n;
+	pcm->refs = 0;
+	pcm->evicted = FALSE;
+
+	struct list_head evicted;
+	INIT_LIST_HEAD(&evicted);
+
+	pthread_mutex_lock(&cache->m_pcm);
+
+	struct soundcache_pcm *_pcm, *__pcm;
+
+	/* two pipelines may have decoded the same input at once */
+	list_for_each_entry(_pcm, &cache->pcm, l_pcm) {
+		if (soundcache_id_equal(&_pcm->id, id)) {
+			pthread_mutex_unlock(&cache->m_pcm);
+
+			soundcache_pcm_free(pcm);
+
+			return;
+		}
+	}
+
+	while (cache->size + size > cache->budget) {
+		struct soundcache_pcm *lru = list_entry(cache->pcm.prev, struct soundcache_pcm, l_pcm);
+
+		list_del(&lru->l_pcm);
+
+		cache->size -= soundcache_pcm_size(lru->n);
+
+		if (lru->refs) {
+			lru->evicted = TRUE;
+		} else {
+			list_add(&lru->l_pcm, &evicted);
+		}
+	}
+
+	list_add(&pcm->l_pcm, &cache->pcm);
+
+	cache->size += size;
+
+	pthread_mutex_unlock(&cache->m_pcm);
+
+	list_for_each_entry_safe(_pcm, __pcm, &evicted, l_pcm) {
+		soundcache_pcm_free(_pcm);
+	}
+}
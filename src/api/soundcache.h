@@ -0,0 +1,127 @@
+#ifndef SOUNDCACHE_H_
+#define SOUNDCACHE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "../net/audio.h"
+#include "../list.h"
+#include "../types.h"
+
+/* forward declaration to avoid circular dependency with sound.h */
+struct input;
+
+/* clips encoding to more than this are played, but not kept */
+#define SOUNDCACHE_CLIP_MAX_SIZE (256 * 1024)
+
+#define SOUNDCACHE_PACKET_BUDGET (4 * 1024 * 1024)
+
+/* no single decoded input may take more than this share of the PCM budget */
+#define SOUNDCACHE_PCM_ENTRY_SHARE 4
+
+/* identifies the content of an input, whatever part of it is played */
+struct soundcache_id {
+	int type;
+	char *name;
+	int64_t mtime;
+	int64_t size;
+	uint64_t hash;
+};
+
+/* everything the encoded packets of a playback depend on */
+struct soundcache_key {
+	struct soundcache_id id;
+	float from;
+	float to;
+	float volume;
+	int codec_version;
+	int bitrate;
+	int frames;
+};
+
+/* one encoded packet, its data lives in the clip at off */
+struct soundcache_packet {
+	int type;
+	int frames;
+	int n;
+	uint32_t term;
+	uint16_t len[AUDIO_MAX_FRAMES + 1];
+	size_t off;
+};
+
+struct soundcache_clip {
+	struct soundcache_key key;
+	struct soundcache_packet *packet;
+	int n;
+	int size;
+	unsigned char *data;
+	size_t len;
+	size_t data_size;
+	struct list_head l_clips;
+};
+
+/* encoded clips, most recently played first */
+struct soundcache {
+	struct list_head clips;
+	size_t size;
+	size_t budget;
+	uint32_t hits;
+	uint32_t misses;
+};
+
+/* the complete decoded input, shared by all pipelines reading it */
+struct soundcache_pcm {
+	struct soundcache_id id;
+	audio_frame *frame;
+	int n;
+	int refs;
+	bool evicted;
+	struct list_head l_pcm;
+};
+
+/* decoded inputs, most recently used first; used from the decoder threads */
+struct soundcache_pcm_cache {
+	struct list_head pcm;
+	size_t size;
+	size_t budget;
+	uint32_t hits;
+	uint32_t misses;
+	pthread_mutex_t m_pcm;
+};
+
+int soundcache_id_init(struct soundcache_id *, struct input *);
+
+void soundcache_id_copy(struct soundcache_id *, const struct soundcache_id *);
+
+void soundcache_id_free(struct soundcache_id *);
+
+bool soundcache_id_equal(const struct soundcache_id *, const struct soundcache_id *);
+
+struct soundcache * soundcache_new(size_t);
+
+void soundcache_free(struct soundcache *);
+
+struct soundcache_clip * soundcache_lookup(struct soundcache *, const struct soundcache_key *);
+
+void soundcache_insert(struct soundcache *, struct soundcache_clip *);
+
+struct soundcache_clip * soundcache_clip_new(const struct soundcache_key *);
+
+void soundcache_clip_free(struct soundcache_clip *);
+
+bool soundcache_clip_append(struct soundcache_clip *, struct packet *, int);
+
+void soundcache_clip_get(struct soundcache_clip *, int, struct packet *, struct audio *);
+
+struct soundcache_pcm_cache * soundcache_pcm_cache_new(size_t);
+
+void soundcache_pcm_cache_free(struct soundcache_pcm_cache *);
+
+struct soundcache_pcm * soundcache_pcm_get(struct soundcache_pcm_cache *, const struct soundcache_id *);
+
+void soundcache_pcm_put(struct soundcache_pcm_cache *, struct soundcache_pcm *);
+
+void soundcache_pcm_insert(struct soundcache_pcm_cache *, const struct soundcache_id *, audio_frame *, int);
+
+#endif /* SOUNDCACHE_H_ */
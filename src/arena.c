@@ -0,0 +1,78 @@
+#include <stdlib.h>
+
+#include "arena.h"
+#include "types.h"
+
+#define arena_align(n) (((n) + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1))
+
+static struct arena_chunk * arena_chunk_new(size_t size) {
+	struct arena_chunk *chunk = malloc(sizeof(struct arena_chunk) + size);
+	if (!chunk) return NULL;
+
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+
+	return chunk;
+}
+
+struct arena * arena_new(size_t chunk_size) {
+	struct arena *a = malloc(sizeof(struct arena));
+
+	a->chunk_size = arena_align(chunk_size);
+	a->head = arena_chunk_new(a->chunk_size);
+
+	return a;
+}
+
+void arena_free(struct arena *a) {
+	while (a->head) {
+		struct arena_chunk *chunk = a->head;
+		a->head = chunk->next;
+
+		free(chunk);
+	}
+
+	free(a);
+}
+
+void * arena_alloc(struct arena *a, size_t n) {
+	n = arena_align(n ? n : 1);
+
+	struct arena_chunk *chunk = a->head;
+
+	if (!chunk || chunk->used + n > chunk->size) {
+		/* oversized requests get a chunk of their own */
+		if (!(chunk = arena_chunk_new(n > a->chunk_size ? n : a->chunk_size))) return NULL;
+
+		chunk->next = a->head;
+		a->head = chunk;
+	}
+
+	void *p = chunk->data + chunk->used;
+	chunk->used += n;
+
+	return p;
+}
+
+void arena_reset(struct arena *a) {
+	struct arena_chunk *chunk = a->head;
+	if (!chunk) return;
+
+	/* the oldest chunk sits at the end of the list and is the one that is kept */
+	while (chunk->next) {
+		a->head = chunk->next;
+
+		free(chunk);
+
+		chunk = a->head;
+	}
+
+	if (chunk->size != a->chunk_size) {
+		free(chunk);
+
+		a->head = arena_chunk_new(a->chunk_size);
+	} else {
+		chunk->used = 0;
+	}
+}
@@ -0,0 +1,34 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+#include "types.h"
+
+#define ARENA_ALIGNMENT 16
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	unsigned char data[] __attribute__((aligned(ARENA_ALIGNMENT)));
+};
+
+/*
+ * bump allocator for short-lived objects; nothing is freed individually,
+ * arena_reset releases everything at once and keeps the first chunk around
+ */
+struct arena {
+	struct arena_chunk *head;
+	size_t chunk_size;
+};
+
+struct arena * arena_new(size_t);
+
+void arena_free(struct arena *);
+
+void * arena_alloc(struct arena *, size_t);
+
+void arena_reset(struct arena *);
+
+#endif /* ARENA_H_ */
@@ -0,0 +1,277 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "celtcodec.h"
+#include "console.h"
+#include "net/audio.h"
+#include "net/connection.h"
+#include "net/crypt.h"
+#include "net/message.h"
+#include "net/varint.h"
+#include "api/sound.h"
+#include "types.h"
+
+/*
+ * microbenchmarks for the per-packet paths; every result is printed as one
+ * JSON object per line so the output can be diffed or fed to other tools
+ */
+
+#define BENCH_ITERATIONS 200000
+
+#define BENCH_PAYLOAD_SIZE 120
+
+static FILE *out;
+
+static uint64_t bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_report(const char *name, int n, uint64_t ns) {
+	double per_op = (double) ns / n;
+
+	fprintf(out, "{\"benchmark\":\"%s\",\"iterations\":%i,\"ns_per_op\":%.1f,\"ops_per_sec\":%.0f}\n", name, n, per_op, 1e9 / per_op);
+	fflush(out);
+}
+
+#define bench(name, n, body) do { \
+	int __i; \
+	uint64_t __start = bench_now(); \
+	for (__i = 0; __i < (n); __i++) { body; } \
+	bench_report(name, n, bench_now() - __start); \
+} while (0)
+
+/* keeps the compiler from optimizing away results */
+static volatile uint64_t sink;
+
+static void bench_crypt() {
+	unsigned char key[AES_BLOCK_SIZE], iv[AES_BLOCK_SIZE];
+
+	int i;
+	for (i = 0; i < AES_BLOCK_SIZE; i++) {
+		key[i] = rand();
+		iv[i] = rand();
+	}
+
+	struct crypt tx, rx;
+	crypt_reset(&tx);
+	crypt_reset(&rx);
+
+	crypt_init(&tx, key, iv, iv);
+	crypt_init(&rx, key, iv, iv);
+
+	unsigned char plain[BENCH_PAYLOAD_SIZE];
+	for (i = 0; i < BENCH_PAYLOAD_SIZE; i++) {
+		plain[i] = rand();
+	}
+
+	int n = BENCH_ITERATIONS;
+
+	/* decryption has to see the packets in order, so they are prepared up front */
+	unsigned char *packets = malloc(n * (BENCH_PAYLOAD_SIZE + CRYPT_HEADER_SIZE));
+
+	bench("crypt_encrypt", n, crypt_encrypt(&tx, plain, packets + __i * (BENCH_PAYLOAD_SIZE + CRYPT_HEADER_SIZE), BENCH_PAYLOAD_SIZE));
+
+	unsigned char dst[BENCH_PAYLOAD_SIZE];
+	bench("crypt_decrypt", n, sink += crypt_decrypt(&rx, packets + __i * (BENCH_PAYLOAD_SIZE + CRYPT_HEADER_SIZE), dst, BENCH_PAYLOAD_SIZE + CRYPT_HEADER_SIZE));
+
+	if (rx.good != n) fprintf(stderr, "crypt_decrypt: only %u of %i packets decrypted\n", rx.good, n);
+
+	free(packets);
+
+	crypt_free(&tx);
+	crypt_free(&rx);
+}
+
+static void bench_varint() {
+	uint64_t values[256];
+
+	int i;
+	for (i = 0; i < 256; i++) {
+		values[i] = (uint64_t) rand() >> (rand() % 31);
+	}
+
+	unsigned char buf[VARINT_MAX_SIZE * 256];
+	int len[256], off[256];
+
+	for (i = 0, off[0] = 0; i < 256; i++) {
+		len[i] = varint_encode(values[i], buf + off[i], VARINT_MAX_SIZE);
+		if (i < 255) off[i + 1] = off[i] + len[i];
+	}
+
+	bench("varint_encode", BENCH_ITERATIONS, sink += varint_encode(values[__i & 0xFF], buf + off[__i & 0xFF], VARINT_MAX_SIZE));
+
+	bench("varint_decode", BENCH_ITERATIONS, {
+		uint64_t v;
+		sink += varint_decode(buf + off[__i & 0xFF], len[__i & 0xFF], &v);
+		sink += v;
+	});
+}
+
+static void bench_audio() {
+	struct audio audio[3];
+
+	struct packet p = audio_new(UDP_TYPE_CELT_BETA, UDP_TARGET_NORMAL);
+	p.payload.sequence = 12345;
+	p.payload.has_positional_audio = FALSE;
+	p.payload.audio = audio;
+
+	int i, j;
+	for (i = 0; i < 3; i++) {
+		audio[i].term = (i < 2);
+		audio[i].len = (i < 2) ? 60 : 0;
+		audio[i].data = audio[i].frame;
+
+		for (j = 0; j < audio[i].len; j++) {
+			audio[i].frame[j] = rand();
+		}
+	}
+
+	udp_buffer buf;
+	int len = audio_serialize(&p, buf, UDP_BUFFER_SIZE);
+
+	bench("audio_serialize", BENCH_ITERATIONS, sink += audio_serialize(&p, buf, UDP_BUFFER_SIZE));
+
+	bench("audio_deserialize", BENCH_ITERATIONS, {
+		struct packet *d;
+		sink += audio_deserialize(&d, buf, len);
+		audio_free(d);
+	});
+
+	struct packet_pool *pool = packet_pool_new(1);
+
+	bench("audio_deserialize_view", BENCH_ITERATIONS, {
+		struct packet *d = packet_pool_get(pool);
+		sink += audio_deserialize_view(d, buf, len);
+		audio_free(d);
+	});
+
+	packet_pool_free(pool);
+}
+
+static void bench_message() {
+	struct connection *con = connection_new("localhost", "64738", NULL, 72000, 2);
+
+	/* pretend to be the engine of an established control channel */
+	con->channel.control.connected = TRUE;
+	con->channel.control.tid = pthread_self();
+	con->channel.control.tx.buf = malloc(CONTROL_TX_SIZE);
+	con->channel.control.tx.size = CONTROL_TX_SIZE;
+
+	MumbleProto__TextMessage msg = message_new(TEXT_MESSAGE);
+
+	uint32_t session = 1;
+	msg.n_session = 1;
+	msg.session = &session;
+	msg.message = "the quick brown fox jumps over the lazy dog";
+
+	bench("message_send", BENCH_ITERATIONS, {
+		sink += message_send(con, m_TEXT_MESSAGE, &msg);
+		con->channel.control.tx.len = 0;
+	});
+
+	con->channel.control.connected = FALSE;
+
+	free(con->channel.control.tx.buf);
+
+	connection_free(con);
+}
+
+static void bench_sound() {
+	audio_frame frames[2];
+
+	int i;
+	for (i = 0; i < FRAME_SIZE; i++) {
+		frames[0][i] = (int16_t) (sin(i * 0.05) * 16000);
+		frames[1][i] = (int16_t) (cos(i * 0.03) * 16000);
+	}
+
+	audio_frame mix;
+
+	bench("sound_mix_frame", BENCH_ITERATIONS, {
+		sound_mix_frame(frames[0], frames[1], mix);
+		sink += mix[__i % FRAME_SIZE];
+	});
+
+	/* alternating factors keep the samples from converging to zero */
+	bench("sound_adjust_volume", BENCH_ITERATIONS, {
+		sound_adjust_volume(frames, 1, (__i & 1) ? 0.5f : 2.0f);
+		sink += frames[0][__i % FRAME_SIZE];
+	});
+}
+
+static void bench_celt() {
+	audio_frame frame;
+
+	int i;
+	for (i = 0; i < FRAME_SIZE; i++) {
+		frame[i] = (int16_t) (sin(i * 0.05) * 16000);
+	}
+
+	struct celtcodec *cc;
+	list_for_each_entry(cc, celtcodec_list(), l_codecs) {
+		CELTEncoder *cencoder = cc->encoder_create(cc);
+		CELTDecoder *cdecoder = cc->decoder_create(cc);
+
+		cc->set_bitrate(cc, cencoder, 72000);
+
+		unsigned char data[127];
+		int len = cc->encode(cc, cencoder, frame, 1, data, 90);
+
+		char name[64];
+
+		snprintf(name, 64, "celt_%s_encode", cc->version);
+		bench(name, BENCH_ITERATIONS / 10, sink += cc->encode(cc, cencoder, frame, 1, data, 90));
+
+		audio_frame decoded;
+
+		snprintf(name, 64, "celt_%s_decode", cc->version);
+		bench(name, BENCH_ITERATIONS / 10, sink += cc->decode(cc, cdecoder, data, len, decoded, 1));
+
+		cc->encoder_destroy(cencoder);
+		cc->decoder_destroy(cdecoder);
+	}
+}
+
+int main(int argc, char **argv) {
+	out = stdout;
+
+	if (argc > 1 && !(out = fopen(argv[1], "w"))) {
+		fprintf(stderr, "failed to open %s for writing\n", argv[1]);
+
+		return EXIT_FAILURE;
+	}
+
+	srand(0);
+
+	console_init();
+
+	openssl_init();
+
+	bench_crypt();
+
+	bench_varint();
+
+	bench_audio();
+
+	bench_message();
+
+	bench_sound();
+
+	if (celtcodec_load_all()) bench_celt();
+
+	celtcodec_free_all();
+
+	openssl_cleanup();
+
+	console_free();
+
+	if (out != stdout) fclose(out);
+
+	return EXIT_SUCCESS;
+}
@@ -12,13 +12,27 @@
 
 #define _RESOLVE(cc, s, l, n) cc->s = dlsym(cc->handle, n); if (!cc->s) { console_error(_CLASS, cc->version, "failed to resolve symbol %s in %s (%s)\n", n, l, dlerror()); goto err; }
 
+/* the libraries are loaded at runtime, so the few Opus constants needed are repeated here */
+#define OPUS_APPLICATION_VOIP 2048
+#define OPUS_SET_BITRATE_REQUEST 4002
+
 static const char *s_version[] = {
 	"0.11.0",
-	"0.7.0"
+	"0.7.0",
+	"opus"
+};
+
+static const char *s_name[] = {
+	"CELT 0.11.0",
+	"CELT 0.7.0",
+	"Opus"
 };
 
 static LIST_HEAD(celtcodecs);
 
+/* Opus packets are looked up for every datagram, there is at most one Opus codec */
+static struct celtcodec *opuscodec = NULL;
+
 static CELTEncoder * celt_encoder_create_wrapper(struct celtcodec *cc) {
 	CELTEncoder *cencoder;
 
@@ -35,13 +49,19 @@ static CELTEncoder * celt_encoder_create_wrapper(struct celtcodec *cc) {
 	return ((int (*)(CELTEncoder *, const celt_int16 *, celt_int16 *, unsigned char *, int))cc->__celt_encode)(*ce, pcm, NULL, compressed, n);
 }*/
 
-static int celt070_celt_encode_wrapper(struct celtcodec *cc, CELTEncoder *cencoder, const celt_int16 *pcm, unsigned char *compressed, int n) {
+static void celt_set_bitrate_wrapper(struct celtcodec *cc, CELTEncoder *cencoder, int bitrate) {
+	cc->encoder_ctl(cencoder, CELT_SET_PREDICTION(0));
+	cc->encoder_ctl(cencoder, CELT_SET_BITRATE(bitrate));
+}
+
+/* CELT packets always hold a single frame, frames is ignored */
+static int celt070_celt_encode_wrapper(struct celtcodec *cc, CELTEncoder *cencoder, const celt_int16 *pcm, int frames, unsigned char *compressed, int n) {
 	int c = ((int (*)(CELTEncoder *, const celt_int16 *, celt_int16 *, unsigned char *, int))cc->__celt_encode)(cencoder, pcm, NULL, compressed, n);
 	if (c < 0) console_error(_CLASS, cc->version, "failed to encode audio frame (%s)\n", cc->__celt_strerror(c));
 	return c;
 }
 
-static int celt011_celt_encode_wrapper(struct celtcodec *cc, CELTEncoder *cencoder, const celt_int16 *pcm, unsigned char *compressed, int n) {
+static int celt011_celt_encode_wrapper(struct celtcodec *cc, CELTEncoder *cencoder, const celt_int16 *pcm, int frames, unsigned char *compressed, int n) {
 	int c = ((int (*)(CELTEncoder *, const celt_int16 *, int, unsigned char *, int))cc->__celt_encode)(cencoder, pcm, FRAME_SIZE, compressed, n);
 	if (c < 0) console_error(_CLASS, cc->version, "failed to encode audio frame (%s)\n", cc->__celt_strerror(c));
 	return c;
@@ -58,22 +78,85 @@ static CELTDecoder * celt_decoder_create_wrapper(struct celtcodec *cc) {
 	return cdecoder;
 }
 
-static int celt070_celt_decode_wrapper(struct celtcodec *cc, CELTDecoder *cdecoder, const unsigned char *data, int len, celt_int16 *pcm) {
+static int celt070_celt_decode_wrapper(struct celtcodec *cc, CELTDecoder *cdecoder, const unsigned char *data, int len, celt_int16 *pcm, int n) {
 	int c = ((int (*)(CELTDecoder *, const unsigned char *, int, celt_int16 *))cc->__celt_decode)(cdecoder, data, len, pcm);
 	if (c < 0) console_error(_CLASS, cc->version, "failed to decode audio frame (%s)\n", cc->__celt_strerror(c));
-	return c;
+	return c < 0 ? c : 1;
 }
 
-static int celt011_celt_decode_wrapper(struct celtcodec *cc, CELTDecoder *cdecoder, const unsigned char *data, int len, celt_int16 *pcm) {
+static int celt011_celt_decode_wrapper(struct celtcodec *cc, CELTDecoder *cdecoder, const unsigned char *data, int len, celt_int16 *pcm, int n) {
 	int c = ((int (*)(CELTDecoder *, const unsigned char *, int, celt_int16 *, int))cc->__celt_decode)(cdecoder, data, len, pcm, FRAME_SIZE);
 	if (c < 0) console_error(_CLASS, cc->version, "failed to decode audio frame (%s)\n", cc->__celt_strerror(c));
+	return c < 0 ? c : 1;
+}
+
+static CELTEncoder * opus_encoder_create_wrapper(struct celtcodec *cc) {
+	CELTEncoder *cencoder;
+
+	int error;
+	if (!(cencoder = ((CELTEncoder * (*)(celt_int32, int, int, int *)) cc->__opus_encoder_create)(SAMPLE_RATE, CHANNELS, OPUS_APPLICATION_VOIP, &error))) {
+		console_error(_CLASS, cc->version, "failed to create encoder (%s)\n", cc->__celt_strerror(error));
+	}
+
+	return cencoder;
+}
+
+static void opus_set_bitrate_wrapper(struct celtcodec *cc, CELTEncoder *cencoder, int bitrate) {
+	cc->encoder_ctl(cencoder, OPUS_SET_BITRATE_REQUEST, (celt_int32) bitrate);
+}
+
+static int opus_encode_wrapper(struct celtcodec *cc, CELTEncoder *cencoder, const celt_int16 *pcm, int frames, unsigned char *compressed, int n) {
+	int c = ((int (*)(CELTEncoder *, const celt_int16 *, int, unsigned char *, celt_int32))cc->__celt_encode)(cencoder, pcm, frames * FRAME_SIZE, compressed, n);
+	if (c < 0) console_error(_CLASS, cc->version, "failed to encode audio frame (%s)\n", cc->__celt_strerror(c));
 	return c;
 }
 
+static CELTDecoder * opus_decoder_create_wrapper(struct celtcodec *cc) {
+	CELTDecoder *cdecoder;
+
+	int error;
+	if (!(cdecoder = ((CELTDecoder * (*)(celt_int32, int, int *)) cc->__opus_decoder_create)(SAMPLE_RATE, CHANNELS, &error))) {
+		console_error(_CLASS, cc->version, "failed to create decoder (%s)\n", cc->__celt_strerror(error));
+	}
+
+	return cdecoder;
+}
+
+static int opus_decode_wrapper(struct celtcodec *cc, CELTDecoder *cdecoder, const unsigned char *data, int len, celt_int16 *pcm, int n) {
+	int c = ((int (*)(CELTDecoder *, const unsigned char *, celt_int32, celt_int16 *, int, int))cc->__celt_decode)(cdecoder, data, len, pcm, n * FRAME_SIZE, 0);
+	if (c < 0) console_error(_CLASS, cc->version, "failed to decode audio frame (%s)\n", cc->__celt_strerror(c));
+	return c < 0 ? c : c / FRAME_SIZE;
+}
+
+/* Opus needs neither a mode nor a bitstream version, only the encoder and decoder */
+static bool opuscodec_resolve(struct celtcodec *cc) {
+	_RESOLVE(cc, __opus_encoder_create, cc->dll, "opus_encoder_create")
+	_RESOLVE(cc, __celt_encoder_destroy, cc->dll, "opus_encoder_destroy")
+	_RESOLVE(cc, __celt_encoder_ctl, cc->dll, "opus_encoder_ctl")
+	_RESOLVE(cc, __celt_encode, cc->dll, "opus_encode")
+	_RESOLVE(cc, __opus_decoder_create, cc->dll, "opus_decoder_create")
+	_RESOLVE(cc, __celt_decoder_destroy, cc->dll, "opus_decoder_destroy")
+	_RESOLVE(cc, __celt_decode, cc->dll, "opus_decode")
+	_RESOLVE(cc, __celt_strerror, cc->dll, "opus_strerror")
+
+	cc->encoder_create = opus_encoder_create_wrapper;
+	cc->decoder_create = opus_decoder_create_wrapper;
+	cc->set_bitrate = opus_set_bitrate_wrapper;
+
+	cc->cmode = NULL;
+	cc->bitstream_version = OPUS_BITSTREAM_VERSION;
+
+	return TRUE;
+
+	err:
+	return FALSE;
+}
+
 struct celtcodec * celtcodec_new(int version) {
 	struct celtcodec *cc = malloc(sizeof(struct celtcodec));
 	cc->handle = NULL;
 	cc->dll = NULL;
+	cc->opus = FALSE;
 
 	char *sn_celt_encoder_create, *sn_celt_decoder_create;
 
@@ -92,15 +175,25 @@ struct celtcodec * celtcodec_new(int version) {
 			cc->encode = celt011_celt_encode_wrapper;
 			cc->decode = celt011_celt_decode_wrapper;
 			break;
+		case CELT_VERSION_OPUS:
+			cc->version = s_version[version];
+			cc->opus = TRUE;
+			cc->encode = opus_encode_wrapper;
+			cc->decode = opus_decode_wrapper;
+			break;
 		default:
 			console_error(_CLASS, _NONE, "unsupported CELT version requested\n");
 
 			goto err;
 	}
 
-	cc->dll = strdup("libcelt.so.");
-	cc->dll = realloc(cc->dll, strlen(cc->dll) + strlen(cc->version) + 1);
-	strcat(cc->dll, cc->version);
+	if (cc->opus) {
+		cc->dll = strdup("libopus.so.0");
+	} else {
+		cc->dll = strdup("libcelt.so.");
+		cc->dll = realloc(cc->dll, strlen(cc->dll) + strlen(cc->version) + 1);
+		strcat(cc->dll, cc->version);
+	}
 
 	cc->handle = dlopen(cc->dll, RTLD_LAZY);
 	if (!cc->handle) {
@@ -109,6 +202,16 @@ struct celtcodec * celtcodec_new(int version) {
 		goto err;
 	}
 
+	if (cc->opus) {
+		if (!opuscodec_resolve(cc)) goto err;
+
+		list_add_tail(&cc->l_codecs, &celtcodecs);
+
+		opuscodec = cc;
+
+		return cc;
+	}
+
 	_RESOLVE(cc, __celt_mode_create, cc->dll, "celt_mode_create")
 	_RESOLVE(cc, __celt_mode_destroy, cc->dll, "celt_mode_destroy")
 	_RESOLVE(cc, __celt_mode_info, cc->dll, "celt_mode_info")
@@ -123,6 +226,7 @@ struct celtcodec * celtcodec_new(int version) {
 
 	cc->encoder_create = celt_encoder_create_wrapper;
 	cc->decoder_create = celt_decoder_create_wrapper;
+	cc->set_bitrate = celt_set_bitrate_wrapper;
 
 	int error;
 
@@ -158,7 +262,9 @@ struct celtcodec * celtcodec_new(int version) {
 void celtcodec_free(struct celtcodec *cc) {
 	list_del(&cc->l_codecs);
 
-	cc->__celt_mode_destroy(cc->cmode);
+	if (cc == opuscodec) opuscodec = NULL;
+
+	if (!cc->opus) cc->__celt_mode_destroy(cc->cmode);
 
 	dlclose(cc->handle);
 
@@ -176,10 +282,10 @@ bool celtcodec_load_all() {
 	for (i = 0; i < __CELT_UNSUPPORTED; i++) {
 		cc = celtcodec_new(i);
 		if (cc) {
-			console_message(_CLASS, _NONE, "successfully initialized CELT %s\n", cc->version);
+			console_message(_CLASS, _NONE, "successfully initialized %s\n", s_name[i]);
 			s = TRUE;
 		} else {
-			console_error(_CLASS, _NONE, "failed to initialize CELT %s\n", s_version[i]);
+			console_error(_CLASS, _NONE, "failed to initialize %s\n", s_name[i]);
 		}
 	}
 
@@ -189,23 +295,26 @@ bool celtcodec_load_all() {
 void celtcodec_free_all() {
 	struct celtcodec *cc, *n;
 	list_for_each_entry_safe(cc, n, &celtcodecs, l_codecs) {
-		console_message(_CLASS, _NONE, "unloading CELT %s\n", cc->version);
+		if (cc->opus) {
+			console_message(_CLASS, _NONE, "unloading Opus\n");
+		} else {
+			console_message(_CLASS, _NONE, "unloading CELT %s\n", cc->version);
+		}
 		celtcodec_free(cc);
 	}
 }
 
+/* -1 picks the first CELT codec, returns NULL if no matching codec is loaded */
 struct celtcodec * celtcodec_get(int bitstream_version) {
-	struct celtcodec *cc = NULL;
+	if (bitstream_version == OPUS_BITSTREAM_VERSION) return opuscodec;
 
-	if (bitstream_version == -1) {
-		cc = list_first_entry(&celtcodecs, struct celtcodec, l_codecs);
-	} else {
-		list_for_each_entry(cc, &celtcodecs, l_codecs) {
-			if (cc->bitstream_version == bitstream_version) break;
-		}
+	struct celtcodec *cc;
+
+	list_for_each_entry(cc, &celtcodecs, l_codecs) {
+		if (bitstream_version == -1 ? !cc->opus : cc->bitstream_version == bitstream_version) return cc;
 	}
 
-	return cc;
+	return NULL;
 }
 
 struct list_head * celtcodec_list() {
@@ -17,19 +17,32 @@
 enum {
 	CELT_VERSION_0_11_0,
 	CELT_VERSION_0_7_0,
+	CELT_VERSION_OPUS,
 	__CELT_UNSUPPORTED
 };
 
 enum {
 	CELT_ALPHA,
-	CELT_BETA
+	CELT_BETA,
+	CELT_OPUS
 };
 
+/* Opus has a single bitstream, this stands in for its version */
+#define OPUS_BITSTREAM_VERSION -2
+
+/* the longest Opus packet (120 ms) in frames */
+#define OPUS_MAX_FRAMES 12
+
+/*
+ * a dlopen'd codec library, either one of the CELT versions or Opus; Opus
+ * encoders and decoders are passed around as CELTEncoder and CELTDecoder
+ */
 struct celtcodec {
 	void *handle;
 	char *dll;
 	const char *version;
 	int bitstream_version;
+	bool opus;
 	CELTMode *cmode;
 	struct list_head l_codecs;
 	/* functions */
@@ -41,13 +54,18 @@ struct celtcodec {
 	void (*__celt_encoder_destroy)(CELTEncoder *);
 	int (*__celt_encoder_ctl)(CELTEncoder *, int, ...);
 	void *__celt_encode;
-	int (*encode)(struct celtcodec *, CELTEncoder *, const celt_int16 *, unsigned char *, int);
+	/* encodes n consecutive frames into one packet, CELT only ever takes one */
+	int (*encode)(struct celtcodec *, CELTEncoder *, const celt_int16 *, int, unsigned char *, int);
+	void (*set_bitrate)(struct celtcodec *, CELTEncoder *, int);
 	CELTDecoder * (*__celt_decoder_create)(CELTMode *, int, int *);
 	CELTDecoder * (*decoder_create)(struct celtcodec *);
 	void (*__celt_decoder_destroy)(CELTDecoder *);
 	void *__celt_decode;
-	int (*decode)(struct celtcodec *, CELTDecoder *, const unsigned char *, int, celt_int16 *);
+	/* decodes a packet into at most n frames, returns the number of frames decoded */
+	int (*decode)(struct celtcodec *, CELTDecoder *, const unsigned char *, int, celt_int16 *, int);
 	const char * (*__celt_strerror)(int);
+	void *__opus_encoder_create;
+	void *__opus_decoder_create;
 };
 
 #define encoder_destroy(ce) __celt_encoder_destroy(ce)
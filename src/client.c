@@ -13,12 +13,15 @@
 #include "list.h"
 #include "net/message.h"
 #include "plugin.h"
+#include "net/reactor.h"
 #include "timer.h"
 #include "types.h"
 #include "version.h"
 
 #include "net/protobuf/Mumble.pb-c.h"
 
+#define PING_INTERVAL 5000000ULL
+
 static LIST_HEAD(clients);
 
 static int _id = 0;
@@ -35,68 +38,183 @@ static void engine_send_ping(struct connection *con) {
 	MumbleProto__Ping msg = message_new(PING);
 
 	message_set_optional(msg, timestamp, ts);
-	message_set_optional(msg, good, con->channel.voice.crypt.good);
-	message_set_optional(msg, late, con->channel.voice.crypt.late);
-	message_set_optional(msg, lost, con->channel.voice.crypt.lost);
-	message_set_optional(msg, resync, con->channel.voice.crypt.resync);
-	message_set_optional(msg, udp_packets, con->channel.voice.ping.n);
-	message_set_optional(msg, tcp_packets, con->channel.control.ping.n);
-
-	if (con->channel.voice.ping.n) {
-		message_set_optional(msg, udp_ping_avg, con->channel.voice.ping.avg);
-		message_set_optional(msg, udp_ping_var, con->channel.voice.ping.var);
+	uint32_t good, late, lost;
+	crypt_get_stats(&con->channel.voice.crypt, &good, &late, &lost);
+
+	struct ping udp, tcp;
+	connection_get_ping(con, &con->channel.voice.ping, &udp);
+	connection_get_ping(con, &con->channel.control.ping, &tcp);
+
+	message_set_optional(msg, good, good);
+	message_set_optional(msg, late, late);
+	message_set_optional(msg, lost, lost);
+	message_set_optional(msg, resync, crypt_get_resync(&con->channel.voice.crypt));
+	message_set_optional(msg, udp_packets, udp.n);
+	message_set_optional(msg, tcp_packets, tcp.n);
+
+	if (udp.n) {
+		message_set_optional(msg, udp_ping_avg, udp.avg);
+		message_set_optional(msg, udp_ping_var, udp.var);
 	}
 
-	if (con->channel.control.ping.n) {
-		message_set_optional(msg, tcp_ping_avg, con->channel.control.ping.avg);
-		message_set_optional(msg, tcp_ping_var, con->channel.control.ping.var);
+	if (tcp.n) {
+		message_set_optional(msg, tcp_ping_avg, tcp.avg);
+		message_set_optional(msg, tcp_ping_var, tcp.var);
 	}
 
 	message_send(con, m_PING, &msg);
 }
 
-/*static void * voice_engine(void *arg) {
-	struct client *c = (struct client *) arg;
-	struct connection *con = c->con;
+static void engine_on_ping(struct reactor *r, struct reactor_handler *h, uint32_t events) {
+	struct client *c = (struct client *) h->arg;
 
-	if (voice_open(con)) {
-		printf("engine: error: failed to establish voice channel to %s:%s\n", con->host, con->port);
+	if (!reactor_timer_read(h->fd)) return;
 
-		pthread_exit(NULL);
+	console_debug("engine", c->username, "pinging TCP/UDP channels\n");
+	engine_send_ping(c->con);
+}
+
+static void engine_dispatch_audio(struct client *c, struct packet *pkt) {
+	if (pkt->type == UDP_TYPE_PING) {
+		console_debug("engine", c->username, "UDP ping received (timestamp: %llX)\n", pkt->payload.timestamp);
 	} else {
-		printf("engine: established voice channel to %s:%s\n", con->host, con->port);
+		console_debug("engine", c->username, "voice packet received (session: %lli sequence: %lli)\n", pkt->payload.session, pkt->payload.sequence);
 	}
 
-	while (con->channel.control.connected) {
-		struct packet *pkt;
+	handler_dispatch(&c->dispatch, c, m_AUDIO, pkt);
+}
 
-		int r;
-		if ((r = audio_recv(con, &pkt)) < 0) break;
+static void engine_on_voice(struct reactor *r, struct reactor_handler *h, uint32_t events) {
+	struct client *c = (struct client *) h->arg;
+	struct connection *con = c->con;
 
-		if (r == 0) {
-			if (con->channel.voice.crypt.request) {
-				con->channel.voice.crypt.request = FALSE;
+	struct packet *pkts[VOICE_BATCH_SIZE];
 
-				MumbleProto__CryptSetup msg = message_new(CRYPT_SETUP);
+	int n, s, t = 0;
 
-				message_send(con, m_CRYPT_SETUP, &msg);
-			}
+	/* a full batch means there might be more datagrams queued up */
+	do {
+		s = audio_recv_batch(con, c->voice.pool, pkts, &n);
 
-			continue;
+		if (s > 0) t += s;
+
+		int i;
+		for (i = 0; i < n; i++) {
+			engine_dispatch_audio(c, pkts[i]);
+
+			audio_free(pkts[i]);
 		}
+	} while (s == VOICE_BATCH_SIZE);
+
+	voice_account_wakeup(con, t);
 
-		printf("voice packet received\n");
+	if (con->channel.voice.crypt.request) {
+		con->channel.voice.crypt.request = FALSE;
 
-		if (c->handler[m_AUDIO].registered) c->handler[m_AUDIO].process(c, pkt);
+		MumbleProto__CryptSetup msg = message_new(CRYPT_SETUP);
 
-		audio_free(pkt);
+		message_send(con, m_CRYPT_SETUP, &msg);
 	}
+}
 
-	printf("engine: closing voice channel to %s:%s\n", con->host, con->port);
-	voice_close(con);
+static void engine_on_voice_tick(struct reactor *r, struct reactor_handler *h, uint32_t events) {
+	struct client *c = (struct client *) h->arg;
+
+	if (!reactor_timer_read(h->fd)) return;
+
+	voice_flush_queue(c->con);
+}
+
+static void * voice_engine(void *arg) {
+	struct client *c = (struct client *) arg;
+
+	console_message("engine", c->username, "voice engine running\n");
+
+	reactor_run(&c->voice.reactor);
+
+	console_message("engine", c->username, "voice engine shutting down\n");
 
 	pthread_exit(NULL);
-}*/
+}
+
+static int engine_start_voice(struct client *c) {
+	struct connection *con = c->con;
+
+	c->io.voice = reactor_handler_new(con->channel.voice.socket, EPOLLIN, engine_on_voice, c);
+	c->io.tick = reactor_handler_new(con->channel.voice.queue->timer, EPOLLIN, engine_on_voice_tick, c);
+
+	if (!settings.voice_thread) {
+		c->voice.threaded = FALSE;
+
+		return reactor_add(&c->reactor, &c->io.voice) || reactor_add(&c->reactor, &c->io.tick);
+	}
+
+	if (reactor_init(&c->voice.reactor)) return -1;
+
+	if (reactor_add(&c->voice.reactor, &c->io.voice) || reactor_add(&c->voice.reactor, &c->io.tick) || pthread_create(&c->voice.tid, NULL, voice_engine, (void *) c)) {
+		reactor_free(&c->voice.reactor);
+
+		return -1;
+	}
+
+	c->voice.threaded = TRUE;
+
+	return 0;
+}
+
+static void engine_stop_voice(struct client *c) {
+	if (!c->voice.threaded) return;
+
+	reactor_stop(&c->voice.reactor);
+
+	pthread_join(c->voice.tid, NULL);
+
+	reactor_free(&c->voice.reactor);
+
+	c->voice.threaded = FALSE;
+}
+
+static void engine_on_control(struct reactor *r, struct reactor_handler *h, uint32_t events) {
+	struct client *c = (struct client *) h->arg;
+	struct connection *con = c->con;
+
+	void *msg;
+	uint16_t type;
+
+	int s;
+	while ((s = message_recv(con, c->dispatch.listening, &type, &msg)) > 0) {
+		/* tunneled voice takes the same path as voice received over UDP */
+		if (type == m_AUDIO) {
+			engine_dispatch_audio(c, (struct packet *) msg);
+
+			continue;
+		}
+
+		console_debug("engine", c->username, "message %s received\n", s_message[type]);
+
+		handler_dispatch(&c->dispatch, c, type, msg);
+	}
+
+	if (s < 0 || (events & (EPOLLERR | EPOLLHUP) && s == 0)) reactor_stop(r);
+}
+
+static void engine_on_notify(struct reactor *r, struct reactor_handler *h, uint32_t events) {
+	struct client *c = (struct client *) h->arg;
+
+	if (control_flush_queue(c->con) < 0) reactor_stop(r);
+}
+
+/* everything written during the last round of callbacks goes out in one go */
+static void engine_on_idle(struct reactor *r, void *arg) {
+	struct client *c = (struct client *) arg;
+
+	/* the handlers are done with whatever was received, drop it in one go */
+	message_free_all(c->con);
+
+	int s = control_flush(c->con);
+
+	if (s < 0 || reactor_modify(r, &c->io.control, s ? EPOLLIN | EPOLLOUT : EPOLLIN)) reactor_stop(r);
+}
 
 static void * engine(void *arg) {
 	struct client *c = (struct client *) arg;
@@ -135,7 +253,11 @@ static void * engine(void *arg) {
 	struct celtcodec *cc;
 	struct list_head *codecs = celtcodec_list();
 	list_for_each_entry(cc, codecs, l_codecs) {
-		message_add_repeated(amsg, celt_versions, cc->bitstream_version);
+		if (cc->opus) {
+			message_set_optional(amsg, opus, TRUE);
+		} else {
+			message_add_repeated(amsg, celt_versions, cc->bitstream_version);
+		}
 	}
 
 	console_message("engine", c->username, "authenticating as %s...\n", c->username);
@@ -143,82 +265,46 @@ static void * engine(void *arg) {
 
 	message_free_repeated(amsg, celt_versions);
 
-	/*printf("engine: starting voice engine\n");
-	pthread_t vtid;
-	pthread_create(&vtid, NULL, voice_engine, (void *) c);*/
-
 	console_message("engine", c->username, "establishing voice channel to %s:%s...\n", con->host, con->port);
 	if (voice_open(con)) {
 		console_warning("engine", c->username, "failed to establish voice channel to %s:%s\n", con->host, con->port);
 		console_warning("engine", c->username, "UDP mode disabled\n");
 	}
 
-	struct timer ping = TIMER_INIT;
-
-	while (!c->exit) {
-		if (timer_is_elapsed(&ping, 5000000ULL)) {
-			console_debug("engine", c->username, "pinging TCP/UDP channels\n");
-			engine_send_ping(con);
-		}
-
-		struct profile *p;
-
-		int r;
-
-		if (con->channel.voice.connected) {
-
-			struct packet *pkt;
-
-			r = audio_recv(con, &pkt);
-
-			if (r == 0) {
-				if (con->channel.voice.crypt.request) {
-					con->channel.voice.crypt.request = FALSE;
-
-					MumbleProto__CryptSetup msg = message_new(CRYPT_SETUP);
-
-					message_send(con, m_CRYPT_SETUP, &msg);
-				}
-			} else if (r > 0) {
-				if (pkt->type == UDP_TYPE_PING) {
-					console_debug("engine", c->username, "UDP ping received (timestamp: %llX)\n", pkt->payload.timestamp);
-				} else {
-					console_debug("engine", c->username, "voice packet received (session: %lli sequence: %lli)\n", pkt->payload.session, pkt->payload.sequence);
-				}
+	c->io.control = reactor_handler_new(con->channel.control.socket, EPOLLIN, engine_on_control, c);
+	c->io.notify = reactor_handler_new(con->channel.control.notify, EPOLLIN, engine_on_notify, c);
+	c->io.ping = reactor_handler_new(reactor_timer_open(PING_INTERVAL), EPOLLIN, engine_on_ping, c);
 
-				//if (c->handler[m_AUDIO].registered) c->handler[m_AUDIO].process(c, pkt);
-				for_each_profile(p, c->profiles) {
-					if (p->handler[m_AUDIO].registered) p->handler[m_AUDIO].process(c, pkt);
-				}
+	if (c->io.ping.fd < 0 || reactor_add(&c->reactor, &c->io.control) || reactor_add(&c->reactor, &c->io.notify) || reactor_add(&c->reactor, &c->io.ping)) {
+		console_error("engine", c->username, "failed to set up event loop\n");
 
-				audio_free(pkt);
-			}
-		}
-
-		void *msg;
-		uint16_t type;
+		goto close_channels;
+	}
 
-		//int r;
-		if ((r = message_recv(con, &type, &msg)) < 0) break;
+	reactor_set_idle(&c->reactor, engine_on_idle, c);
 
-		control_flush_queue(con);
+	if (con->channel.voice.connected) {
+		if (engine_start_voice(c)) {
+			console_warning("engine", c->username, "failed to start voice engine\n");
+			console_warning("engine", c->username, "UDP mode disabled\n");
 
-		if (r == 0) {
-			continue;
+			voice_close(con);
 		}
+	}
 
-		console_debug("engine", c->username, "message %s received\n", s_message[type]);
+	/* messages received before the handlers were registered are still buffered */
+	engine_on_control(&c->reactor, &c->io.control, 0);
 
-		//if (c->handler[type].registered) c->handler[type].process(c, msg);
-		for_each_profile(p, c->profiles) {
-			if (p->handler[type].registered) p->handler[type].process(c, msg);
-		}
+	if (!c->exit) reactor_run(&c->reactor);
 
+	close_channels:
+	if (c->io.ping.fd >= 0) close(c->io.ping.fd);
 
-		message_free(type, msg);
-	}
+	handler_dispatch_report(&c->dispatch, c->username);
 
 	if (con->channel.voice.connected) {
+		engine_stop_voice(c);
+
 		console_message("engine", c->username, "closing voice channel to %s:%s\n", con->host, con->port);
 		voice_close(con);
 	}
@@ -226,8 +312,6 @@ static void * engine(void *arg) {
 	console_message("engine", c->username, "closing control channel to %s:%s\n", con->host, con->port);
 	control_close(con);
 
-	//pthread_join(vtid, NULL);
-
 	engine_exit:
 	console_message("engine", c->username, "shutting down\n");
 
@@ -239,12 +323,32 @@ static void * engine(void *arg) {
 struct client * client_new(char *host, char *port, char *cert, char *user, char *pass, char *plugindir, char *packagedir, char *f_privilege) {
 	struct client *c = malloc(sizeof(struct client));
 
+	/* everything the engine cannot run without is set up first, so failing leaves nothing else to undo */
+	if (reactor_init(&c->reactor)) {
+		console_error("engine", user, "failed to create event loop\n");
+
+		free(c);
+
+		return NULL;
+	}
+
+	if (!(c->voice.pool = packet_pool_new(VOICE_BATCH_SIZE))) {
+		console_error("engine", user, "failed to allocate voice packets\n");
+
+		reactor_free(&c->reactor);
+
+		free(c);
+
+		return NULL;
+	}
+
 	c->id = ++_id;
 	
 	c->con = connection_new(host, port, cert, settings.bitrate, settings.frames);
 
 	c->celt.codec_version[0] = -1;
 	c->celt.codec_version[1] = -1;
+	c->celt.codec_version[2] = -1;
 	c->celt.use = 0;
 	pthread_mutex_init(&c->m_celt, NULL);
 
@@ -259,11 +363,15 @@ struct client * client_new(char *host, char *port, char *cert, char *user, char
 
 	c->restart = TRUE;
 
+	c->voice.threaded = FALSE;
+
 	INIT_LIST_HEAD(&c->profiles);
 
 	handler_profile_bot(&c->profiles);
 	handler_profile_api(&c->profiles);
 
+	handler_dispatch_build(&c->dispatch, &c->profiles);
+
 	c->env = environment_new(c);
 
 	INIT_LIST_HEAD(&c->plugins);
@@ -293,12 +401,18 @@ bool client_free(struct client *c) {
 
 	c->exit = TRUE;
 
+	reactor_stop(&c->reactor);
+
 	bool *_restart;
 	bool restart;
 
 	pthread_join(c->engine, (void **) &_restart);
 	restart = *_restart;
 
+	reactor_free(&c->reactor);
+
+	packet_pool_free(c->voice.pool);
+
 	pthread_mutex_destroy(&c->m_celt);
 
 	connection_free(c->con);
@@ -343,8 +457,9 @@ int client_get_celt_codec_version(struct client *c, int *use) {
 void client_set_celt_codec_version(struct client *c, int alpha, int beta, int use) {
 	pthread_mutex_lock(&c->m_celt);
 
-	c->celt.codec_version[0] = alpha;
-	c->celt.codec_version[1] = beta;
+	c->celt.codec_version[CELT_ALPHA] = alpha;
+	c->celt.codec_version[CELT_BETA] = beta;
+	c->celt.codec_version[CELT_OPUS] = (use == CELT_OPUS) ? OPUS_BITSTREAM_VERSION : -1;
 	c->celt.use = use;
 
 	pthread_mutex_unlock(&c->m_celt);
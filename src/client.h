@@ -3,12 +3,14 @@
 
 #include <pthread.h>
 
+#include "net/audio.h"
 #include "net/connection.h"
 #include "controller.h"
 #include "api/environment.h"
 #include "handler.h"
 #include "list.h"
 #include "net/message.h"
+#include "net/reactor.h"
 #include "types.h"
 
 struct client {
@@ -16,7 +18,7 @@ struct client {
 	int id;
 	struct connection *con;
 	struct {
-		int codec_version[2];
+		int codec_version[3];
 		int use;
 	} celt;
 	pthread_mutex_t m_celt;
@@ -24,10 +26,25 @@ struct client {
 	char *password;
 	uint32_t session;
 	pthread_t engine;
+	struct reactor reactor;
+	struct {
+		struct reactor_handler control;
+		struct reactor_handler voice;
+		struct reactor_handler tick;
+		struct reactor_handler notify;
+		struct reactor_handler ping;
+	} io;
+	struct {
+		pthread_t tid;
+		struct reactor reactor;
+		struct packet_pool *pool;
+		bool threaded;
+	} voice;
 	bool running;
 	bool exit;
 	bool restart;
 	struct list_head profiles;
+	struct dispatch dispatch;
 	struct environment *env;
 	char *plugindir;
 	char *packagedir;
@@ -17,7 +17,9 @@ struct config settings = {
 	.debug = FALSE,
 	.bitrate = 40000, 
 	.frames = 2,
-	.volume = 0.10
+	.volume = 0.10,
+	.voice_thread = FALSE,
+	.pcm_cache = 64
 };
 
 static void usage() {
@@ -62,6 +64,12 @@ static void usage() {
 	printf("	--volume VOLUME, -f VOLUME\n");
 	printf("		set default volume of voice transmission to VOLUME\n");
 	printf("\n");
+	printf("	--voice-thread, -t\n");
+	printf("		receive UDP voice packets in a dedicated thread\n");
+	printf("\n");
+	printf("	--pcm-cache SIZE, -m SIZE\n");
+	printf("		keep up to SIZE MB of decoded audio for replays, 0 disables the cache\n");
+	printf("\n");
 }
 
 int config_parse_arguments(int argc, char **argv) {
@@ -78,12 +86,14 @@ int config_parse_arguments(int argc, char **argv) {
 		{ "bitrate", required_argument, NULL, 'b' },
 		{ "frames", required_argument, NULL, 'f' },
 		{ "volume", required_argument, NULL, 'v' },
+		{ "voice-thread", no_argument, NULL, 't' },
+		{ "pcm-cache", required_argument, NULL, 'm' },
 		{ 0 }
 	};
 
 	while (optind < argc) {
 		int index = -1;
-		int result = getopt_long(argc, argv, "h:s:c:u:p:ldb:f:v:", long_options, &index);
+		int result = getopt_long(argc, argv, "h:s:c:u:p:ldb:f:v:tm:", long_options, &index);
 		if (result == -1) return -1;
 
 		switch (result) {
@@ -99,6 +109,8 @@ int config_parse_arguments(int argc, char **argv) {
 			case 'b': sscanf(optarg, "%i", &settings.bitrate); break;
 			case 'f': sscanf(optarg, "%i", &settings.frames); break;
 			case 'v': sscanf(optarg, "%f", &settings.volume); break;
+			case 't': settings.voice_thread = TRUE; break;
+			case 'm': sscanf(optarg, "%i", &settings.pcm_cache); break;
 
 			case '?':
 			case ':':
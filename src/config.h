@@ -16,6 +16,8 @@ struct config {
 	int bitrate;
 	int frames;
 	float volume;
+	bool voice_thread;
+	int pcm_cache;
 };
 
 extern struct config settings;
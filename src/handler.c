@@ -1,6 +1,7 @@
 #include <openssl/aes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "net/audio.h"
 #include "celtcodec.h"
@@ -29,9 +30,12 @@ static void on_audio_message(struct client *c, struct packet *pkt) {
 static void on_ping_message(struct client *c, MumbleProto__Ping *msg) {
 	connection_update_ping(c->con, &c->con->channel.control.ping, msg->timestamp);
 
-	if ((msg->good == 0 || c->con->channel.voice.crypt.good == 0) && c->con->channel.voice.enabled && timer_elapsed(&c->con->timestamp) > 20000000ULL) {
+	uint32_t good, late, lost;
+	crypt_get_stats(&c->con->channel.voice.crypt, &good, &late, &lost);
+
+	if ((msg->good == 0 || good == 0) && c->con->channel.voice.enabled && timer_elapsed(&c->con->timestamp) > 20000000ULL) {
 		c->con->channel.voice.enabled = FALSE;
-		if (msg->good == 0 && c->con->channel.voice.crypt.good == 0) {
+		if (msg->good == 0 && good == 0) {
 			console_warning(_CLASS, c->username, "UDP packets cannot be sent to or received from server\n");
 		} else if (msg->good == 0) {
 			console_warning(_CLASS, c->username, "UDP packets cannot be sent to server\n");
@@ -39,10 +43,12 @@ static void on_ping_message(struct client *c, MumbleProto__Ping *msg) {
 			console_warning(_CLASS, c->username, "UDP packets cannot be received from server\n");
 		}
 		console_message(_CLASS, c->username, "switching to TCP mode\n");
-	} else if (!c->con->channel.voice.enabled && msg->good > 3 && c->con->channel.voice.crypt.good > 3) {
+	} else if (!c->con->channel.voice.enabled && msg->good > 3 && good > 3) {
 		c->con->channel.voice.enabled = TRUE;
 		console_message(_CLASS, c->username, "switching back to UDP mode\n");
 	}
+
+	connection_adapt_audio(c->con, msg->good, msg->late, msg->lost);
 }
 
 static void on_crypt_setup_message(struct client *c, MumbleProto__CryptSetup *msg) {
@@ -54,10 +60,7 @@ static void on_crypt_setup_message(struct client *c, MumbleProto__CryptSetup *ms
 		}
 	} else if (msg->has_server_nonce) {
 		if (msg->server_nonce.len == AES_BLOCK_SIZE) {
-			c->con->channel.voice.crypt.resync++;
-			//pthread_mutex_lock(&c->con->channel.voice.m_crypt);
-			memcpy(c->con->channel.voice.crypt.decrypt_iv, msg->server_nonce.data, AES_BLOCK_SIZE);
-			//pthread_mutex_unlock(&c->con->channel.voice.m_crypt);
+			crypt_resync(&c->con->channel.voice.crypt, msg->server_nonce.data);
 		}
 	} else {
 		MumbleProto__CryptSetup rsp = message_new(CRYPT_SETUP);
@@ -65,9 +68,7 @@ static void on_crypt_setup_message(struct client *c, MumbleProto__CryptSetup *ms
 		rsp.has_client_nonce = TRUE;
 		rsp.client_nonce.data = malloc(AES_BLOCK_SIZE);
 		rsp.client_nonce.len = AES_BLOCK_SIZE;
-		pthread_mutex_lock(&c->con->channel.voice.m_crypt);
-		memcpy(rsp.client_nonce.data, c->con->channel.voice.crypt.encrypt_iv, AES_BLOCK_SIZE);
-		pthread_mutex_unlock(&c->con->channel.voice.m_crypt);
+		crypt_get_encrypt_iv(&c->con->channel.voice.crypt, rsp.client_nonce.data);
 
 		message_send(c->con, m_CRYPT_SETUP, &rsp);
 
@@ -120,7 +121,10 @@ static void on_codec_version_message(struct client *c, MumbleProto__CodecVersion
 	int beta = msg->beta;
 	bool pref = msg->prefer_alpha;
 
-	if (pref && celtcodec_get(alpha)) {
+	/* CELT versions are still tracked for decoding clients that lack Opus */
+	if (msg->has_opus && msg->opus && celtcodec_get(OPUS_BITSTREAM_VERSION)) {
+		client_set_celt_codec_version(c, celtcodec_get(alpha) ? alpha : -1, celtcodec_get(beta) ? beta : -1, CELT_OPUS);
+	} else if (pref && celtcodec_get(alpha)) {
 		client_set_celt_codec_version(c, alpha, -1, CELT_ALPHA);
 	} else if (celtcodec_get(beta)) {
 		client_set_celt_codec_version(c, -1, beta, CELT_BETA);
@@ -198,3 +202,53 @@ void handler_profile_bot(struct list_head *profiles) {
 
 	list_add_tail(&p->l_profiles, profiles);
 }
+
+void handler_dispatch_build(struct dispatch *d, struct list_head *profiles) {
+	memset(d, 0, sizeof(struct dispatch));
+
+	struct profile *p;
+	list_for_each_entry(p, profiles, l_profiles) {
+		int t;
+		for (t = 0; t < NUM_MESSAGES; t++) {
+			if (!p->handler[t].registered) continue;
+
+			if (d->type[t].n == HANDLER_MAX_PROFILES) {
+				console_error(_CLASS, _NONE, "too many handlers for %s messages\n", s_message[t]);
+
+				continue;
+			}
+
+			d->type[t].process[d->type[t].n++] = p->handler[t].process;
+			d->listening |= 1 << t;
+		}
+	}
+}
+
+static uint64_t handler_dispatch_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* audio is dispatched from the voice thread as well, hence the atomic counters */
+void handler_dispatch(struct dispatch *d, struct client *c, uint16_t type, void *msg) {
+	uint64_t start = handler_dispatch_now();
+
+	int i;
+	for (i = 0; i < d->type[type].n; i++) {
+		d->type[type].process[i](c, msg);
+	}
+
+	__sync_fetch_and_add(&d->type[type].count, 1);
+	__sync_fetch_and_add(&d->type[type].time, handler_dispatch_now() - start);
+}
+
+void handler_dispatch_report(struct dispatch *d, const char *username) {
+	int t;
+	for (t = 0; t < NUM_MESSAGES; t++) {
+		if (!d->type[t].count) continue;
+
+		console_debug(_CLASS, username, "%s: %llu dispatched, %.1f us per message (%.1f ms total)\n", s_message[t], d->type[t].count, (double) d->type[t].time / d->type[t].count / 1000.0, (double) d->type[t].time / 1000000.0);
+	}
+}
@@ -28,6 +28,30 @@ struct profile {
 
 #define for_each_profile(p, l) list_for_each_entry(p, &l, l_profiles)
 
+#define HANDLER_MAX_PROFILES 8
+
+/*
+ * the registered profiles compiled into a flat array of handlers per message
+ * type, has to be rebuilt whenever a profile is registered or unregistered
+ */
+struct dispatch {
+	struct {
+		void (*process[HANDLER_MAX_PROFILES])(struct client *, void *);
+		int n;
+		/* messages dispatched and nanoseconds spent in their handlers */
+		uint64_t count;
+		uint64_t time;
+	} type[NUM_MESSAGES];
+	/* bit t is set if anybody handles messages of type t */
+	uint32_t listening;
+};
+
 void handler_profile_bot(struct list_head *);
 
+void handler_dispatch_build(struct dispatch *, struct list_head *);
+
+void handler_dispatch(struct dispatch *, struct client *, uint16_t, void *);
+
+void handler_dispatch_report(struct dispatch *, const char *);
+
 #endif /* HANDLER_H_ */
@@ -23,7 +23,7 @@ void sigint_handler(int signal) {
 static void run() {
 	struct client *bot = client_new(settings.host, settings.port, settings.cert, settings.username, settings.password, "plugins/", "packages/", "privilege.lua");
 
-	while (!sigint) {
+	while (bot && !sigint) {
 		if (!bot->running) {
 			bool retry = client_free(bot);
 
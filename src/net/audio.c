@@ -1,5 +1,6 @@
 #include <celt/celt.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "audio.h"
 #include "../celtcodec.h"
@@ -18,113 +19,275 @@
 
 #define VOICE_POSITIONAL_AUDIO_SIZE (3 * sizeof(float))
 
+#define OPUS_TERMINATOR 0x2000
+
+#define OPUS_LENGTH_MASK 0x1FFF
+
 #define packet_set_header(p, b, i) (b)[i] = (p->type << 5) | p->target
 #define packet_get_header(p, b, i) p->type = b[i] >> 5; p->target = b[i] & 0x1F
 
 #define packet_set_data_header(d, b, i) (b)[i] = (d.term << 7) | d.len
 #define packet_get_data_header(d, b, i) d.term = b[i] >> 7; d.len = b[i] & 0x7F
 
-void audio_free(struct packet *p) {
-	if (p->type != UDP_TYPE_PING && p->payload.audio) free(p->payload.audio);
+struct pooled_packet {
+	struct packet p;
+	struct audio audio[AUDIO_MAX_FRAMES];
+};
+
+struct packet_pool * packet_pool_new(int size) {
+	struct packet_pool *pool = malloc(sizeof(struct packet_pool));
+	if (!pool) return NULL;
+
+	pool->size = size;
+	pool->n = 0;
+
+	if (!(pool->free = malloc(size * sizeof(struct packet *)))) {
+		free(pool);
+
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->m_pool, NULL);
+
+	while (pool->n < size) {
+		struct pooled_packet *pp = malloc(sizeof(struct pooled_packet));
+		if (!pp) {
+			packet_pool_free(pool);
+
+			return NULL;
+		}
+
+		pool->free[pool->n++] = &pp->p;
+	}
 
-	free(p);
+	return pool;
 }
 
-int audio_serialize(struct packet *p, unsigned char **buf, int off) {
-	if (!off) *buf = NULL;
+void packet_pool_free(struct packet_pool *pool) {
+	while (pool->n) {
+		free(pool->free[--pool->n]);
+	}
 
-	int i = off;
+	pthread_mutex_destroy(&pool->m_pool);
 
-	*buf = realloc(*buf, i + VOICE_HEADER_SIZE);
-	packet_set_header(p, *buf, i);
-	i += VOICE_HEADER_SIZE;
+	free(pool->free);
 
-	unsigned char *varint;
-	int len;
-	
-	if (p->type == UDP_TYPE_PING) {
-		len = varint_encode(p->payload.timestamp, &varint);
+	free(pool);
+}
+
+/* falls back to the heap if the pool is exhausted, packet_pool_put releases those again */
+struct packet * packet_pool_get(struct packet_pool *pool) {
+	struct packet *p = NULL;
+
+	pthread_mutex_lock(&pool->m_pool);
+
+	if (pool->n) p = pool->free[--pool->n];
+
+	pthread_mutex_unlock(&pool->m_pool);
+
+	if (!p) p = &((struct pooled_packet *) malloc(sizeof(struct pooled_packet)))->p;
+
+	p->pool = pool;
+	p->payload.audio = ((struct pooled_packet *) p)->audio;
+
+	return p;
+}
 
-		*buf = realloc(*buf, i + len);
-		memcpy(*buf + i, varint, len);
-		i += len;
+void packet_pool_put(struct packet_pool *pool, struct packet *p) {
+	pthread_mutex_lock(&pool->m_pool);
 
-		free(varint);
+	if (pool->n < pool->size) {
+		pool->free[pool->n++] = p;
+
+		p = NULL;
+	}
+
+	pthread_mutex_unlock(&pool->m_pool);
+
+	if (p) free(p);
+}
+
+void audio_free(struct packet *p) {
+	if (p->pool) {
+		packet_pool_put(p->pool, p);
 	} else {
-		len = varint_encode(p->payload.sequence, &varint);
+		free(p);
+	}
+}
 
-		*buf = realloc(*buf, i + len);
-		memcpy(*buf + i, varint, len);
-		i += len;
-		free(varint);
+/*
+ * serializes into a caller-owned buffer of the given size, nothing is
+ * allocated; returns -1 if the packet does not fit
+ */
+int audio_serialize(struct packet *p, unsigned char *buf, int size) {
+	int i = 0;
 
-		int j;
-		bool last;
-		for (j = 0, last = FALSE; !last; last = !p->payload.audio[j].term, j++) {
-			*buf = realloc(*buf, i + VOICE_DATA_HEADER_SIZE + p->payload.audio[j].len);
-			packet_set_data_header(p->payload.audio[j], *buf, i);
-			i += VOICE_DATA_HEADER_SIZE;
-			if (p->payload.audio[j].len) memcpy(*buf + i, p->payload.audio[j].frame, p->payload.audio[j].len);
-			i += p->payload.audio[j].len;
+	if (size < VOICE_HEADER_SIZE) return -1;
+
+	packet_set_header(p, buf, i);
+	i += VOICE_HEADER_SIZE;
+
+	int r;
+
+	if (p->type == UDP_TYPE_PING) {
+		if ((r = varint_encode(p->payload.timestamp, buf + i, size - i)) < 0) return -1;
+		i += r;
+	} else {
+		if ((r = varint_encode(p->payload.sequence, buf + i, size - i)) < 0) return -1;
+		i += r;
+
+		if (p->type == UDP_TYPE_OPUS) {
+			struct audio *a = &p->payload.audio[0];
+
+			if ((r = varint_encode(a->len | (a->term ? OPUS_TERMINATOR : 0), buf + i, size - i)) < 0) return -1;
+			i += r;
+
+			if (i + a->len > size) return -1;
+
+			if (a->len) memcpy(buf + i, a->data, a->len);
+			i += a->len;
+		} else {
+			int j;
+			bool last;
+			for (j = 0, last = FALSE; !last; last = !p->payload.audio[j].term, j++) {
+				if (i + VOICE_DATA_HEADER_SIZE + p->payload.audio[j].len > size) return -1;
+
+				packet_set_data_header(p->payload.audio[j], buf, i);
+				i += VOICE_DATA_HEADER_SIZE;
+				if (p->payload.audio[j].len) memcpy(buf + i, p->payload.audio[j].data, p->payload.audio[j].len);
+				i += p->payload.audio[j].len;
+			}
 		}
 
 		if (p->payload.has_positional_audio) {
-			*buf = realloc(*buf, i + VOICE_POSITIONAL_AUDIO_SIZE);
-			memcpy(*buf + i, &p->payload.x, VOICE_POSITIONAL_AUDIO_SIZE);
+			if (i + VOICE_POSITIONAL_AUDIO_SIZE > size) return -1;
+
+			memcpy(buf + i, &p->payload.x, VOICE_POSITIONAL_AUDIO_SIZE);
 			i += VOICE_POSITIONAL_AUDIO_SIZE;
 		}
 	}
 
-	return i - off;
+	return i;
 }
 
-int audio_deserialize(struct packet **packet, unsigned char *buf, int len) {
-	*packet = malloc(sizeof(struct packet));
-	struct packet *p = *packet;
-
+/*
+ * decodes a packet without copying its frames, they point into buf and are
+ * only valid as long as buf is; p->payload.audio has to provide room for
+ * AUDIO_MAX_FRAMES frames
+ */
+int audio_deserialize_view(struct packet *p, unsigned char *buf, int len) {
 	int i = 0;
 
+	if (len < VOICE_HEADER_SIZE) return -1;
+
 	packet_get_header(p, buf, i);
 	i += VOICE_HEADER_SIZE;
 
+	int r;
+
 	if (p->type == UDP_TYPE_PING) {
-		i += varint_decode(buf + i, &p->payload.timestamp);
+		if ((r = varint_decode(buf + i, len - i, &p->payload.timestamp)) < 0) return -1;
+		i += r;
 	} else {
-		i += varint_decode(buf + i, &p->payload.session);
-		i += varint_decode(buf + i, &p->payload.sequence);
-
-		p->payload.audio = NULL;
-
-		int j;
-		bool last;
-		for (j = 0, last = FALSE; !last; last = !p->payload.audio[j].term, j++) {
-			p->payload.audio = realloc(p->payload.audio, (j + 1) * sizeof(struct audio));
-			packet_get_data_header(p->payload.audio[j], buf, i);
-			i += VOICE_DATA_HEADER_SIZE;
-			if (p->payload.audio[j].len) memcpy(p->payload.audio[j].frame, buf + i, p->payload.audio[j].len);
-			i += p->payload.audio[j].len;
+		if ((r = varint_decode(buf + i, len - i, &p->payload.session)) < 0) return -1;
+		i += r;
+		if ((r = varint_decode(buf + i, len - i, &p->payload.sequence)) < 0) return -1;
+		i += r;
+
+		if (p->type == UDP_TYPE_OPUS) {
+			uint64_t header;
+
+			if ((r = varint_decode(buf + i, len - i, &header)) < 0) return -1;
+			i += r;
+
+			p->payload.audio[0].term = (header & OPUS_TERMINATOR) ? 1 : 0;
+			p->payload.audio[0].len = header & OPUS_LENGTH_MASK;
+			p->payload.audio[0].data = buf + i;
+			i += p->payload.audio[0].len;
+		} else {
+			int j;
+			bool last;
+			for (j = 0, last = FALSE; !last; last = !p->payload.audio[j].term, j++) {
+				if (j == AUDIO_MAX_FRAMES || i >= len) return -1;
+
+				packet_get_data_header(p->payload.audio[j], buf, i);
+				i += VOICE_DATA_HEADER_SIZE;
+				p->payload.audio[j].data = buf + i;
+				i += p->payload.audio[j].len;
+			}
 		}
 
-		if (len > i) {
+		p->payload.has_positional_audio = FALSE;
+
+		if (len >= i + VOICE_POSITIONAL_AUDIO_SIZE) {
 			p->payload.has_positional_audio = TRUE;
 			memcpy(&p->payload.x, buf + i, VOICE_POSITIONAL_AUDIO_SIZE);
 			i += VOICE_POSITIONAL_AUDIO_SIZE;
 		}
 	}
 
+	if (i > len) return -1;
+
 	return i;
 }
 
+/* allocates a self-contained copy which can outlive buf, released by audio_free */
+int audio_deserialize(struct packet **packet, unsigned char *buf, int len) {
+	struct audio audio[AUDIO_MAX_FRAMES];
+
+	struct packet view;
+	view.payload.audio = audio;
+
+	int r = audio_deserialize_view(&view, buf, len);
+	if (r < 0) {
+		*packet = NULL;
+
+		return -1;
+	}
+
+	int n = 0;
+	if (view.type == UDP_TYPE_OPUS) {
+		n = 1;
+	} else if (view.type != UDP_TYPE_PING) {
+		while (audio[n++].term);
+	}
+
+	/* Opus packets may exceed a frame's buffer, their data goes behind the frames */
+	int extra = (view.type == UDP_TYPE_OPUS) ? audio[0].len : 0;
+
+	*packet = malloc(sizeof(struct packet) + n * sizeof(struct audio) + extra);
+	struct packet *p = *packet;
+
+	*p = view;
+	p->pool = NULL;
+
+	if (n) {
+		p->payload.audio = (struct audio *) (p + 1);
+
+		int j;
+		for (j = 0; j < n; j++) {
+			p->payload.audio[j].term = audio[j].term;
+			p->payload.audio[j].len = audio[j].len;
+			p->payload.audio[j].data = extra ? (unsigned char *) &p->payload.audio[n] : p->payload.audio[j].frame;
+			memcpy(p->payload.audio[j].data, audio[j].data, audio[j].len);
+		}
+	}
+
+	return r;
+}
+
 int audio_send(struct connection *con, struct packet *p) {
 	if ((p->type == UDP_TYPE_PING) || con->channel.voice.enabled) {
-		unsigned char *buf;
-		int len = audio_serialize(p, &buf, 0);
+		udp_buffer buf;
 
-		int s = voice_send(con, buf, len);
+		int len = audio_serialize(p, buf, UDP_BUFFER_SIZE - CRYPT_HEADER_SIZE);
+		if (len < 0) {
+			console_error(_CLASS, _NONE, "packet exceeds maximum datagram size\n");
 
-		if (buf) free(buf);
+			return -1;
+		}
 
-		return s;
+		return voice_send(con, buf, len);
 	} else {
 		return message_send(con, m_UDPTUNNEL, p);
 	}
@@ -135,13 +298,37 @@ int audio_recv(struct connection *con, struct packet **p) {
 
 	int len = voice_recv(con, buf);
 
-	if (len > 0) {
-		audio_deserialize(p, buf, len);
-	}
+	if (len > 0 && audio_deserialize(p, buf, len) < 0) return 0;
 
 	return len;
 }
 
+/* packets reference the voice batch and have to be released before receiving the next one */
+int audio_recv_batch(struct connection *con, struct packet_pool *pool, struct packet **p, int *n) {
+	struct voice_batch *b = con->channel.voice.batch;
+
+	int r = voice_recv_batch(con, b);
+
+	*n = 0;
+
+	if (r > 0) {
+		int i;
+		for (i = 0; i < b->n; i++) {
+			p[*n] = packet_pool_get(pool);
+
+			if (audio_deserialize_view(p[*n], b->packet[i], b->len[i]) < 0) {
+				console_debug(_CLASS, _NONE, "dropping malformed voice packet (%i bytes)\n", b->len[i]);
+
+				audio_free(p[*n]);
+			} else {
+				(*n)++;
+			}
+		}
+	}
+
+	return r;
+}
+
 int audio_celt_encode(struct connection *con, struct celtcodec *cc, CELTEncoder *cencoder, struct packet *p, audio_frame *frames, int n, bool terminator) {
 	/*if (p->type == UDP_TYPE_PING) {
 		console_error(_CLASS, _NONE, "UDP ping packets do not transmit audio\n");
@@ -165,25 +352,40 @@ int audio_celt_encode(struct connection *con, struct celtcodec *cc, CELTEncoder
 
 	int bitrate = connection_get_bitrate(con);
 
-	cc->encoder_ctl(cencoder, CELT_SET_PREDICTION(0));
-	cc->encoder_ctl(cencoder, CELT_SET_BITRATE(bitrate));
+	/*
+	 * all frames go into a single Opus packet in the caller's opus_buffer; the
+	 * encoder is only asked for a rate whose packets fit into it
+	 */
+	if (cc->opus) {
+		struct audio *a = &p->payload.audio[0];
+
+		bitrate = min(bitrate, OPUS_MAX_PACKET_SIZE * 800 / n);
+
+		cc->set_bitrate(cc, cencoder, bitrate);
+
+		int len = cc->encode(cc, cencoder, frames[0], n, a->data, bitrate * n / 800);
+		if (len < 0) return -1;
+
+		a->len = len;
+		a->term = terminator ? 1 : 0;
 
-	p->payload.audio = malloc(sizeof(struct audio) * (n + (terminator ? 1 : 0)));
+		return n;
+	}
+
+	cc->set_bitrate(cc, cencoder, bitrate);
 
 	int i;
 	for (i = 0; i < n; i++) {
-		int len = cc->encode(cc, cencoder, frames[i], p->payload.audio[i].frame, min(bitrate / 800, sizeof(p->payload.audio[i].frame)));
-		if (len < 0) {
-			free(p->payload.audio);
-
-			return -1;
-		}
+		int len = cc->encode(cc, cencoder, frames[i], 1, p->payload.audio[i].frame, min(bitrate / 800, sizeof(p->payload.audio[i].frame)));
+		if (len < 0) return -1;
 
+		p->payload.audio[i].data = p->payload.audio[i].frame;
 		p->payload.audio[i].len = len;
 		p->payload.audio[i].term = (i == n - 1 ? (terminator ? 1 : 0) : 1);
 	}
 
 	if (terminator) {
+		p->payload.audio[i].data = p->payload.audio[i].frame;
 		p->payload.audio[i].term = 0;
 		p->payload.audio[i].len = 0;
 	}
@@ -212,13 +414,27 @@ int audio_celt_decode(struct connection *con, struct celtcodec *cc, CELTDecoder
 
 	*frames = NULL;
 
+	if (cc->opus) {
+		*frames = malloc(sizeof(audio_frame) * OPUS_MAX_FRAMES);
+
+		int n = cc->decode(cc, cdecoder, p->payload.audio[0].data, p->payload.audio[0].len, (*frames)[0], OPUS_MAX_FRAMES);
+		if (n <= 0) {
+			free(*frames);
+			*frames = NULL;
+
+			return n < 0 ? -1 : 0;
+		}
+
+		return n;
+	}
+
 	int i;
 	bool last;
 	for (i = 0, last = FALSE; !last; last = !p->payload.audio[i].term, i++) {
 		if (!p->payload.audio[i].len) break; /* terminator frame */
 
 		*frames = realloc(*frames, sizeof(audio_frame) * (i + 1));
-		if (cc->decode(cc, cdecoder, p->payload.audio[i].frame, p->payload.audio[i].len, (*frames)[i]) < 0) {
+		if (cc->decode(cc, cdecoder, p->payload.audio[i].data, p->payload.audio[i].len, (*frames)[i], 1) < 0) {
 			free(*frames);
 
 			return -1;
@@ -2,6 +2,7 @@
 #define AUDIO_H_
 
 #include <celt/celt.h>
+#include <pthread.h>
 
 #include "../celtcodec.h"
 #include "connection.h"
@@ -14,7 +15,8 @@ enum {
 	UDP_TYPE_CELT_ALPHA = 0,
 	UDP_TYPE_PING = 1,
 	UDP_TYPE_SPEEX = 2,
-	UDP_TYPE_CELT_BETA = 3
+	UDP_TYPE_CELT_BETA = 3,
+	UDP_TYPE_OPUS = 4
 };
 
 enum {
@@ -24,17 +26,33 @@ enum {
 	UDP_TARGET_SERVER_LOOPBACK = 31
 };
 
+#define AUDIO_MAX_FRAMES 16
+
+/* an Opus packet carries all frames of a packet and still has to fit into a datagram with its headers */
+#define OPUS_MAX_PACKET_SIZE 960
+
 typedef int16_t audio_frame[FRAME_SIZE];
 
+typedef unsigned char opus_buffer[OPUS_MAX_PACKET_SIZE];
+
+/*
+ * data points either to frame or into the datagram the packet was decoded
+ * from; an Opus packet is a single entry whose term flag marks the end of the
+ * transmission rather than another frame to follow
+ */
 struct audio {
 	unsigned int term : 1;
-	unsigned int len  : 7;
+	unsigned int len  : 13;
+	unsigned char *data;
 	unsigned char frame[127];
 };
 
+struct packet_pool;
+
 struct packet {
 	unsigned int type   : 3;
 	unsigned int target : 5;
+	struct packet_pool *pool;
 	union {
 		struct {
 			uint64_t session;
@@ -49,18 +67,41 @@ struct packet {
 	} payload;
 };
 
+struct packet_pool {
+	int size;
+	int n;
+	struct packet **free;
+	pthread_mutex_t m_pool;
+};
+
 #define audio_new(ty, ta) { .type = ty, .target = ta }
 
+struct packet_pool * packet_pool_new(int);
+
+void packet_pool_free(struct packet_pool *);
+
+struct packet * packet_pool_get(struct packet_pool *);
+
+void packet_pool_put(struct packet_pool *, struct packet *);
+
 void audio_free(struct packet *);
 
-int audio_serialize(struct packet *, unsigned char **, int);
+int audio_serialize(struct packet *, unsigned char *, int);
 
 int audio_deserialize(struct packet **, unsigned char *, int);
 
+int audio_deserialize_view(struct packet *, unsigned char *, int);
+
 int audio_send(struct connection *, struct packet *);
 
 int audio_recv(struct connection *, struct packet **);
 
+int audio_recv_batch(struct connection *, struct packet_pool *, struct packet **, int *);
+
+/*
+ * p->payload.audio has to provide room for n frames plus the terminator; for
+ * Opus, p->payload.audio[0].data has to point to an opus_buffer
+ */
 int audio_celt_encode(struct connection *, struct celtcodec *, CELTEncoder *, struct packet *, audio_frame *, int, bool);
 
 int audio_celt_decode(struct connection *, struct celtcodec *, CELTDecoder *, struct packet *, audio_frame **);
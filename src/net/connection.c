@@ -1,13 +1,18 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
 #include <math.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <openssl/crypto.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
-#include <sys/select.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
@@ -17,6 +22,7 @@
 #include "../console.h"
 #include "crypt.h"
 #include "../list.h"
+#include "reactor.h"
 #include "../timer.h"
 #include "../types.h"
 
@@ -24,15 +30,63 @@
 #define _CONTROL "control"
 #define _VOICE "voice"
 
+#define CONNECTION_ATTEMPT_DELAY 250
+
+#define CONNECTION_TIMEOUT 10000
+
+#define AUDIO_MIN_BITRATE 8000
+
+/* adaptation only judges loss over at least this many packets */
+#define ADAPT_MIN_PACKETS 50
+
+/* nor round trip and jitter before this many pings came back */
+#define ADAPT_MIN_PINGS 4
+
+#define ADAPT_LOSS_HIGH 0.05f
+
+#define ADAPT_LOSS_LOW 0.01f
+
+/* milliseconds */
+#define ADAPT_JITTER_HIGH 30.0f
+
+#define ADAPT_JITTER_LOW 10.0f
+
+#define ADAPT_RTT_HIGH 400.0f
+
+#define ADAPT_MAX_FRAMES 4
+
+#define ADAPT_BITRATE_STEP 4000
+
+#define ADAPT_STABLE_INTERVALS 2
+
 static char s_err[512];
 
 #define save_error_string(e) strerror_r(e, s_err, 512)
 #define get_error_string() s_err
 
-#define max(x, y) (x < y ? y : x)
-
 static pthread_mutex_t *openssl_lock;
 
+/*
+ * contexts and sessions outlive connections, so a client which is torn down
+ * and recreated after a failure can resume its previous TLS session
+ */
+struct tls_context {
+	char *cert;
+	SSL_CTX *ctx;
+	struct list_head l_contexts;
+};
+
+struct tls_session {
+	char *host;
+	char *port;
+	SSL_SESSION *session;
+	struct list_head l_sessions;
+};
+
+static LIST_HEAD(tls_contexts);
+static LIST_HEAD(tls_sessions);
+static pthread_mutex_t m_tls = PTHREAD_MUTEX_INITIALIZER;
+
 static void openssl_lock_callback(int mode, int n, const char *file, int line) {
 	(void) file;
 	(void) line;
@@ -71,6 +125,25 @@ void openssl_init() {
 }
 
 void openssl_cleanup() {
+	struct tls_session *ts, *tn;
+	list_for_each_entry_safe(ts, tn, &tls_sessions, l_sessions) {
+		list_del(&ts->l_sessions);
+
+		SSL_SESSION_free(ts->session);
+		free(ts->host);
+		free(ts->port);
+		free(ts);
+	}
+
+	struct tls_context *cs, *cn;
+	list_for_each_entry_safe(cs, cn, &tls_contexts, l_contexts) {
+		list_del(&cs->l_contexts);
+
+		SSL_CTX_free(cs->ctx);
+		if (cs->cert) free(cs->cert);
+		free(cs);
+	}
+
 	ERR_free_strings();
 
 	int i;
@@ -81,6 +154,279 @@ void openssl_cleanup() {
 	free(openssl_lock);
 }
 
+static struct tls_session * tls_get_session(const char *host, const char *port) {
+	struct tls_session *ts;
+	list_for_each_entry(ts, &tls_sessions, l_sessions) {
+		if (!strcmp(ts->host, host) && !strcmp(ts->port, port)) return ts;
+	}
+
+	return NULL;
+}
+
+static void tls_drop_session(const char *host, const char *port) {
+	pthread_mutex_lock(&m_tls);
+
+	struct tls_session *ts = tls_get_session(host, port);
+	if (ts) {
+		list_del(&ts->l_sessions);
+
+		SSL_SESSION_free(ts->session);
+		free(ts->host);
+		free(ts->port);
+		free(ts);
+	}
+
+	pthread_mutex_unlock(&m_tls);
+}
+
+/* takes ownership of the session by returning 1; TLSv1.3 tickets may arrive after the handshake */
+static int tls_on_new_session(SSL *ssl, SSL_SESSION *session) {
+	struct connection *con = (struct connection *) SSL_get_app_data(ssl);
+	if (!con) return 0;
+
+	pthread_mutex_lock(&m_tls);
+
+	struct tls_session *ts = tls_get_session(con->host, con->port);
+	if (ts) {
+		SSL_SESSION_free(ts->session);
+	} else {
+		ts = malloc(sizeof(struct tls_session));
+
+		ts->host = strdup(con->host);
+		ts->port = strdup(con->port);
+
+		list_add_tail(&ts->l_sessions, &tls_sessions);
+	}
+
+	ts->session = session;
+
+	pthread_mutex_unlock(&m_tls);
+
+	return 1;
+}
+
+/* applies the cached session for host:port to ssl, if there is one */
+static bool tls_resume_session(SSL *ssl, const char *host, const char *port) {
+	bool resume = FALSE;
+
+	pthread_mutex_lock(&m_tls);
+
+	struct tls_session *ts = tls_get_session(host, port);
+	if (ts) resume = SSL_set_session(ssl, ts->session) == 1;
+
+	pthread_mutex_unlock(&m_tls);
+
+	return resume;
+}
+
+static SSL_CTX * tls_get_context(const char *cert) {
+	struct tls_context *tc;
+
+	pthread_mutex_lock(&m_tls);
+
+	list_for_each_entry(tc, &tls_contexts, l_contexts) {
+		if ((!cert && !tc->cert) || (cert && tc->cert && !strcmp(cert, tc->cert))) {
+			pthread_mutex_unlock(&m_tls);
+
+			return tc->ctx;
+		}
+	}
+
+	/* created under the lock, so that clients connecting at once share a single context */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+#else
+	SSL_CTX *ctx = SSL_CTX_new(SSLv23_client_method());
+#endif
+	if (!ctx) {
+		console_error(_CLASS, _CONTROL, "failed to create SSL context object\n");
+
+		pthread_mutex_unlock(&m_tls);
+
+		return NULL;
+	}
+
+	/* negotiate the highest version both sides support, but nothing older than TLSv1 */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	SSL_CTX_set_min_proto_version(ctx, TLS1_VERSION);
+#else
+	SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+#endif
+
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, tls_on_new_session);
+
+	if (cert) {
+		if (SSL_CTX_use_certificate_file(ctx, cert, SSL_FILETYPE_PEM) != 1) {
+			console_error(_CLASS, _CONTROL, "failed to load certificate from file %s\n", cert);
+
+			SSL_CTX_free(ctx);
+
+			pthread_mutex_unlock(&m_tls);
+
+			return NULL;
+		}
+		if (SSL_CTX_use_PrivateKey_file(ctx, cert, SSL_FILETYPE_PEM) != 1) {
+			console_error(_CLASS, _CONTROL, "failed to load private key from file %s\n", cert);
+
+			SSL_CTX_free(ctx);
+
+			pthread_mutex_unlock(&m_tls);
+
+			return NULL;
+		}
+	}
+
+	tc = malloc(sizeof(struct tls_context));
+
+	tc->cert = cert ? strdup(cert) : NULL;
+	tc->ctx = ctx;
+
+	list_add_tail(&tc->l_contexts, &tls_contexts);
+
+	pthread_mutex_unlock(&m_tls);
+
+	return ctx;
+}
+
+/* claims the next free slot for the calling producer, or returns NULL if the queue is full */
+static struct control_slot * control_queue_claim(struct control_queue *q) {
+	struct control_slot *slot;
+
+	uint64_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+	while (TRUE) {
+		slot = &q->slot[pos & (CONTROL_QUEUE_SIZE - 1)];
+
+		int64_t d = (int64_t) __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (int64_t) pos;
+
+		if (d == 0) {
+			if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+		} else if (d < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	return slot;
+}
+
+/* a claimed slot keeps the sequence it was claimed at until it is published */
+static void control_queue_publish(struct control_slot *slot) {
+	__atomic_store_n(&slot->sequence, slot->sequence + 1, __ATOMIC_RELEASE);
+}
+
+/* only takes the lock while the overflow list is in use */
+static bool control_queue_overflow(struct control_queue *q, void *buf, int len, bool force) {
+	if (!force && !__atomic_load_n(&q->overflowed, __ATOMIC_ACQUIRE)) return FALSE;
+
+	pthread_mutex_lock(&q->m_overflow);
+
+	if (!force && !q->overflowed) {
+		pthread_mutex_unlock(&q->m_overflow);
+
+		return FALSE;
+	}
+
+	struct control_overflow *o = malloc(sizeof(struct control_overflow) + len);
+
+	memcpy(o->buf, buf, len);
+	o->len = len;
+
+	list_add_tail(&o->l_overflow, &q->overflow);
+
+	__atomic_store_n(&q->overflowed, TRUE, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&q->m_overflow);
+
+	return TRUE;
+}
+
+static int control_queue_push(struct control_queue *q, void *buf, int len) {
+	if (control_queue_overflow(q, buf, len, FALSE)) return len;
+
+	struct control_slot *slot = control_queue_claim(q);
+	if (!slot) {
+		control_queue_overflow(q, buf, len, TRUE);
+
+		return len;
+	}
+
+	slot->buf = len > CONTROL_SLOT_SIZE ? malloc(len) : slot->data;
+	memcpy(slot->buf, buf, len);
+	slot->len = len;
+
+	control_queue_publish(slot);
+
+	return len;
+}
+
+/* returns the oldest message without removing it, or NULL if the queue is empty */
+static struct control_slot * control_queue_peek(struct control_queue *q) {
+	struct control_slot *slot = &q->slot[q->tail & (CONTROL_QUEUE_SIZE - 1)];
+
+	if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != q->tail + 1) return NULL;
+
+	return slot;
+}
+
+static void control_queue_pop(struct control_queue *q, struct control_slot *slot) {
+	if (slot->buf != slot->data) free(slot->buf);
+
+	__atomic_store_n(&slot->sequence, q->tail + CONTROL_QUEUE_SIZE, __ATOMIC_RELEASE);
+
+	q->tail++;
+}
+
+static struct control_queue * control_queue_new() {
+	struct control_queue *q = malloc(sizeof(struct control_queue));
+
+	q->head = 0;
+	q->tail = 0;
+	q->pending = FALSE;
+
+	int i;
+	for (i = 0; i < CONTROL_QUEUE_SIZE; i++) {
+		q->slot[i].sequence = i;
+	}
+
+	q->overflowed = FALSE;
+	INIT_LIST_HEAD(&q->overflow);
+	pthread_mutex_init(&q->m_overflow, NULL);
+
+	return q;
+}
+
+/* takes the whole overflow list, producers go back to the ring afterwards */
+static void control_queue_take_overflow(struct control_queue *q, struct list_head *list) {
+	INIT_LIST_HEAD(list);
+
+	if (!__atomic_load_n(&q->overflowed, __ATOMIC_ACQUIRE)) return;
+
+	pthread_mutex_lock(&q->m_overflow);
+
+	list_splice_init(&q->overflow, list);
+
+	__atomic_store_n(&q->overflowed, FALSE, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&q->m_overflow);
+}
+
+static void control_queue_free(struct control_queue *q) {
+	struct list_head list;
+	control_queue_take_overflow(q, &list);
+
+	struct control_overflow *o, *_o;
+	list_for_each_entry_safe(o, _o, &list, l_overflow) {
+		free(o);
+	}
+
+	pthread_mutex_destroy(&q->m_overflow);
+
+	free(q);
+}
+
 struct connection * connection_new(const char *host, const char *port, const char *cert, int bitrate, int frames) {
 	struct connection *con = malloc(sizeof(struct connection));
 	memset(con, 0, sizeof(struct connection));
@@ -109,25 +455,55 @@ struct connection * connection_new(const char *host, const char *port, const cha
 	con->audio.celt.use = 0;*/
 	con->audio.bitrate = bitrate;
 	con->audio.frames = frames;
+	con->audio.max_bitrate = bitrate;
+	con->audio.min_frames = frames;
+
+	con->channel.control.queue = control_queue_new();
 
-	pthread_mutex_init(&con->channel.control.m_queue, NULL);
+	con->channel.control.arena = arena_new(CONTROL_ARENA_SIZE);
+
+	/* lives as long as the connection so that late producers never write to a stale descriptor */
+	if ((con->channel.control.notify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		console_error(_CLASS, _CONTROL, "failed to create notify eventfd (%s)\n", strerror(errno));
+	}
 
 	pthread_mutex_init(&con->m_audio, NULL);
 
+	/* the playback threads outlive a reconnect and may still be sending, so the queue lives as long as the connection */
+	con->channel.voice.batch = malloc(sizeof(struct voice_batch));
+
+	con->channel.voice.queue = malloc(sizeof(struct voice_queue));
+	con->channel.voice.queue->n = 0;
+	con->channel.voice.queue->armed = FALSE;
+	con->channel.voice.queue->timer = -1;
+	pthread_mutex_init(&con->channel.voice.queue->m_queue, NULL);
+
 	return con;
 }
 
 void connection_free(struct connection *con) {
-	pthread_mutex_destroy(&con->channel.control.m_queue);
+	if (con->channel.control.notify >= 0) close(con->channel.control.notify);
+
+	pthread_mutex_destroy(&con->channel.voice.queue->m_queue);
+	free(con->channel.voice.queue);
+
+	free(con->channel.voice.batch);
+
+	control_queue_free(con->channel.control.queue);
+
+	arena_free(con->channel.control.arena);
 
 	pthread_mutex_destroy(&con->m_audio);
 
 	free(con);
 }
 
+/* with a voice thread, UDP pings come in there while the engine reads the stats */
 void connection_update_ping(struct connection *con, struct ping *p, uint64_t ts) {
 	float ping = (float) (timer_elapsed(&con->timestamp) - ts) / 1000.0;
 
+	pthread_mutex_lock(&con->m_audio);
+
 	float prev_avg = p->avg;
 
 	if (!++p->n) {
@@ -141,6 +517,25 @@ void connection_update_ping(struct connection *con, struct ping *p, uint64_t ts)
 
 	p->s += (ping - prev_avg) * (ping - p->avg);
 	p->var = sqrt(p->s / p->n);
+
+	/* same weights as TCP's retransmission timer, but jitter only builds up from measured deviations */
+	if (p->n == 1) {
+		p->srtt = ping;
+		p->rttvar = 0;
+	} else {
+		p->rttvar = 0.75f * p->rttvar + 0.25f * fabsf(p->srtt - ping);
+		p->srtt = 0.875f * p->srtt + 0.125f * ping;
+	}
+
+	pthread_mutex_unlock(&con->m_audio);
+}
+
+void connection_get_ping(struct connection *con, struct ping *p, struct ping *copy) {
+	pthread_mutex_lock(&con->m_audio);
+
+	*copy = *p;
+
+	pthread_mutex_unlock(&con->m_audio);
 }
 
 static int connection_get_bandwidth(struct connection *con) {
@@ -152,23 +547,34 @@ static int connection_get_bandwidth(struct connection *con) {
 	return bandwidth;
 }
 
+/* brings bitrate and frames per packet within the server's bandwidth limit */
 static void connection_adjust_bandwidth(struct connection *con) {
 	if (con->max_bandwidth == -1) return;
 
-	int bitrate = con->audio.bitrate;
-	int frames = con->audio.frames;
-
 	if (connection_get_bandwidth(con) > con->max_bandwidth) {
 		if (con->audio.frames <= 4 && con->max_bandwidth <= 32000) con->audio.frames = 4;
 		else if (con->audio.frames == 1 && con->max_bandwidth <= 64000) con->audio.frames = 2;
 		else if (con->audio.frames == 2 && con->max_bandwidth <= 48000) con->audio.frames = 4;
 
-		while (con->audio.bitrate > 8000 && connection_get_bandwidth(con)) {
+		while (con->audio.bitrate > AUDIO_MIN_BITRATE && connection_get_bandwidth(con) > con->max_bandwidth) {
 			con->audio.bitrate -= 1000;
 		}
 	}
 
-	if (con->audio.bitrate <= 8000) con->audio.bitrate = 8000;
+	if (con->audio.bitrate <= AUDIO_MIN_BITRATE) con->audio.bitrate = AUDIO_MIN_BITRATE;
+}
+
+void connection_set_max_bandwidth(struct connection *con, int bandwidth) {
+	if (con->max_bandwidth == bandwidth) return;
+
+	pthread_mutex_lock(&con->m_audio);
+
+	int bitrate = con->audio.bitrate;
+	int frames = con->audio.frames;
+
+	con->max_bandwidth = bandwidth;
+
+	connection_adjust_bandwidth(con);
 
 	if (bitrate != con->audio.bitrate || frames != con->audio.frames) {
 		console_lock();
@@ -176,17 +582,104 @@ static void connection_adjust_bandwidth(struct connection *con) {
 		console_message(_CLASS, _NONE, "audio quality adjusted to %i kbits/s (%i ms)\n", con->audio.bitrate / 1000, con->audio.frames * 10);
 		console_unlock();
 	}
+
+	pthread_mutex_unlock(&con->m_audio);
 }
 
-void connection_set_max_bandwidth(struct connection *con, int bandwidth) {
-	if (con->max_bandwidth == bandwidth) return;
+/* whether the server's bandwidth limit is what keeps the bitrate from going up */
+static bool connection_bitrate_capped(struct connection *con) {
+	if (con->max_bandwidth == -1) return FALSE;
+
+	int bitrate = con->audio.bitrate;
+
+	con->audio.bitrate += 1000;
+
+	bool capped = connection_get_bandwidth(con) > con->max_bandwidth;
+
+	con->audio.bitrate = bitrate;
+
+	return capped;
+}
+
+/* fraction of packets late or lost since the last step, or -1 if there were too few to tell */
+static float connection_audio_loss(struct audio_stats *last, uint32_t good, uint32_t late, uint32_t lost) {
+	float loss = -1.0f;
+
+	/* the counters start over whenever the crypt state is reset */
+	if (good >= last->good && late >= last->late && lost >= last->lost) {
+		uint32_t bad = (late - last->late) + (lost - last->lost);
+		uint32_t total = (good - last->good) + bad;
+
+		if (total >= ADAPT_MIN_PACKETS) loss = (float) bad / total;
+	}
+
+	last->good = good;
+	last->late = late;
+	last->lost = lost;
+
+	return loss;
+}
+
+/*
+ * closed-loop quality control, run whenever the server answers a ping with
+ * its view of the packets we sent (good, late, lost); congestion halves the
+ * packet rate and cuts the bitrate right away, quality is restored step by
+ * step once the link has been clean for a few intervals
+ */
+void connection_adapt_audio(struct connection *con, uint32_t good, uint32_t late, uint32_t lost) {
+	struct ping *ping = con->channel.voice.enabled ? &con->channel.voice.ping : &con->channel.control.ping;
 
 	pthread_mutex_lock(&con->m_audio);
 
-	con->max_bandwidth = bandwidth;
+	float tx = connection_audio_loss(&con->audio.adapt.tx, good, late, lost);
+	uint32_t rx_good, rx_late, rx_lost;
+	crypt_get_stats(&con->channel.voice.crypt, &rx_good, &rx_late, &rx_lost);
+
+	float rx = connection_audio_loss(&con->audio.adapt.rx, rx_good, rx_late, rx_lost);
+
+	float loss = tx > rx ? tx : rx;
+
+	if (ping->n < ADAPT_MIN_PINGS) {
+		pthread_mutex_unlock(&con->m_audio);
+
+		return;
+	}
+
+	int bitrate = con->audio.bitrate;
+	int frames = con->audio.frames;
+
+	if (loss > ADAPT_LOSS_HIGH || ping->rttvar > ADAPT_JITTER_HIGH || ping->srtt > ADAPT_RTT_HIGH) {
+		con->audio.adapt.stable = 0;
+
+		/* fewer, larger packets take pressure off the link and the jitter buffers */
+		if (con->audio.frames < ADAPT_MAX_FRAMES) con->audio.frames *= 2;
+		if (con->audio.frames > ADAPT_MAX_FRAMES) con->audio.frames = ADAPT_MAX_FRAMES;
+
+		con->audio.bitrate = con->audio.bitrate * 3 / 4;
+		if (con->audio.bitrate < AUDIO_MIN_BITRATE) con->audio.bitrate = AUDIO_MIN_BITRATE;
+	} else if (loss < 0) {
+		/* nothing was measured (idle, or tunneled over TCP), which tells nothing about recovery */
+	} else if (loss < ADAPT_LOSS_LOW && ping->rttvar < ADAPT_JITTER_LOW) {
+		if (++con->audio.adapt.stable >= ADAPT_STABLE_INTERVALS) {
+			/* bitrate first, latency once quality is back or the server allows no more */
+			if (con->audio.bitrate < con->audio.max_bitrate && !connection_bitrate_capped(con)) {
+				con->audio.bitrate += ADAPT_BITRATE_STEP;
+				if (con->audio.bitrate > con->audio.max_bitrate) con->audio.bitrate = con->audio.max_bitrate;
+			} else if (con->audio.frames > con->audio.min_frames) {
+				con->audio.frames /= 2;
+				if (con->audio.frames < con->audio.min_frames) con->audio.frames = con->audio.min_frames;
+			}
+		}
+	} else {
+		con->audio.adapt.stable = 0;
+	}
 
 	connection_adjust_bandwidth(con);
 
+	if (bitrate != con->audio.bitrate || frames != con->audio.frames) {
+		console_debug(_CLASS, _NONE, "audio adapted to %i kbit/s (%i ms), loss %.1f%% rtt %.1f ms jitter %.1f ms\n", con->audio.bitrate / 1000, con->audio.frames * 10, loss < 0 ? 0.0 : loss * 100, ping->srtt, ping->rttvar);
+	}
+
 	pthread_mutex_unlock(&con->m_audio);
 }
 
@@ -267,117 +760,235 @@ static int connection_set_nonblock(int fd) {
 	return 0;
 }
 
-static int connection_init_socket(int *s, struct addrinfo *info, bool block, int (*init)(int, const struct sockaddr *, socklen_t)) {
+static int connection_wait(int fd, short events) {
+	struct pollfd pfd = { .fd = fd, .events = events };
+
+	int r;
+	do {
+		r = poll(&pfd, 1, -1);
+	} while (r < 0 && errno == EINTR);
+
+	return r;
+}
+
+/*
+ * connects to one of the resolved addresses; attempts run in parallel, each
+ * started CONNECTION_ATTEMPT_DELAY after the previous one (or as soon as the
+ * previous one fails) with address families interleaved, and the first to
+ * succeed wins (RFC 8305)
+ */
+static int connection_connect(int *s, struct addrinfo *info, struct sockaddr_storage *peer, socklen_t *peer_len) {
+	int n = 0;
+
 	struct addrinfo *i;
-	for (i = info; i; i = i->ai_next) {
-		if ((*s = socket(i->ai_family, i->ai_socktype, i->ai_protocol)) < 0) {
-			save_error_string(errno);
+	for (i = info; i; i = i->ai_next) n++;
 
-			continue;
+	struct addrinfo *first[n], *second[n], *order[n];
+	int n_first = 0, n_second = 0;
+
+	for (i = info; i; i = i->ai_next) {
+		if (i->ai_family == info->ai_family) {
+			first[n_first++] = i;
+		} else {
+			second[n_second++] = i;
 		}
+	}
+
+	int j, k;
+	for (j = 0, k = 0; k < n; j++) {
+		if (j < n_first) order[k++] = first[j];
+		if (j < n_second) order[k++] = second[j];
+	}
+
+	struct pollfd fds[n];
+	struct addrinfo *addr[n];
+	int running = 0, next = 0;
 
-		if (!block) {
-			if (connection_set_nonblock(*s)) {
-				close(*s);
+	struct addrinfo *winner = NULL;
+
+	struct timer t = TIMER_INIT;
+
+	*s = -1;
+
+	while (*s < 0) {
+		if (next < n) {
+			struct addrinfo *a = order[next++];
+
+			int fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+
+			if (fd < 0 || connection_set_nonblock(fd)) {
+				save_error_string(errno);
+
+				if (fd >= 0) close(fd);
 
 				continue;
 			}
-		}
 
-		int error = 0;
-		socklen_t len = sizeof(int);
+			if (!connect(fd, a->ai_addr, a->ai_addrlen)) {
+				*s = fd;
+				winner = a;
 
+				break;
+			}
 
-		if (init(*s, i->ai_addr, i->ai_addrlen)) {
-			if (errno == EINPROGRESS || errno == EWOULDBLOCK) {
-				struct timeval tv = { tv.tv_sec = 10, tv.tv_usec };
+			if (errno != EINPROGRESS) {
+				save_error_string(errno);
 
-				fd_set wfds;
-				FD_ZERO(&wfds);
-				FD_SET(*s, &wfds);
+				close(fd);
 
-				if (select(*s + 1, NULL, &wfds, NULL, &tv) > 0) {
-					if (!getsockopt(*s, SOL_SOCKET, SO_ERROR, &error, &len)) {
-						if (!error) break;
-					}
-				}
+				continue;
 			}
-		} else {
+
+			fds[running].fd = fd;
+			fds[running].events = POLLOUT;
+			addr[running] = a;
+			running++;
+		}
+
+		if (!running) {
+			if (next < n) continue;
+
 			break;
 		}
 
-		if (error) {
-			save_error_string(error);
-		} else {
+		uint64_t elapsed = timer_elapsed(&t) / 1000;
+
+		if (elapsed >= CONNECTION_TIMEOUT) {
+			save_error_string(ETIMEDOUT);
+
+			break;
+		}
+
+		int timeout = CONNECTION_TIMEOUT - elapsed;
+
+		if (next < n && timeout > CONNECTION_ATTEMPT_DELAY) timeout = CONNECTION_ATTEMPT_DELAY;
+
+		int r = poll(fds, running, timeout);
+
+		if (r < 0) {
+			if (errno == EINTR) continue;
+
 			save_error_string(errno);
+
+			break;
+		}
+
+		for (j = 0; r && j < running;) {
+			if (!fds[j].revents) {
+				j++;
+
+				continue;
+			}
+
+			int error = 0;
+			socklen_t len = sizeof(int);
+
+			if (getsockopt(fds[j].fd, SOL_SOCKET, SO_ERROR, &error, &len)) error = errno;
+
+			if (!error) {
+				*s = fds[j].fd;
+				winner = addr[j];
+			} else {
+				save_error_string(error);
+
+				close(fds[j].fd);
+			}
+
+			running--;
+			fds[j] = fds[running];
+			addr[j] = addr[running];
+
+			if (*s >= 0) break;
 		}
+	}
 
-		close(*s);
+	/* the losers of the race */
+	for (j = 0; j < running; j++) {
+		close(fds[j].fd);
 	}
 
-	return i == NULL ? -1 : 0;
+	if (*s < 0) return -1;
+
+	memcpy(peer, winner->ai_addr, winner->ai_addrlen);
+	*peer_len = winner->ai_addrlen;
+
+	return 0;
 }
 
-static int connection_compare_hosts(struct sockaddr *a, socklen_t a_len, struct sockaddr *b, socklen_t b_len, int flags) {
-	char host_a[512], port_a[512], host_b[512], port_b[512];
 
-	if (getnameinfo(a, a_len, host_a, 512, port_a, 512, flags) || getnameinfo(b, b_len, host_b, 512, port_b, 512, flags)) {
-		return -1;
-	} else {
-		return strcmp(host_a, host_b) || strcmp(port_a, port_b);
+/* compares family, address and port as they are, without resolving anything */
+static int connection_compare_hosts(const struct sockaddr *a, const struct sockaddr *b) {
+	if (a->sa_family != b->sa_family) return -1;
+
+	if (a->sa_family == AF_INET) {
+		const struct sockaddr_in *_a = (const struct sockaddr_in *) a, *_b = (const struct sockaddr_in *) b;
+
+		return _a->sin_port != _b->sin_port || _a->sin_addr.s_addr != _b->sin_addr.s_addr;
+	} else if (a->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *_a = (const struct sockaddr_in6 *) a, *_b = (const struct sockaddr_in6 *) b;
+
+		return _a->sin6_port != _b->sin6_port || memcmp(&_a->sin6_addr, &_b->sin6_addr, sizeof(struct in6_addr));
 	}
+
+	return -1;
 }
 
 int control_flush_queue(struct connection *con) {
 	if (!pthread_equal(pthread_self(), con->channel.control.tid)) return -1;
 
-	int t = 0;
+	struct control_queue *q = con->channel.control.queue;
 
-	pthread_mutex_lock(&con->channel.control.m_queue);
+	uint64_t n;
+	while (read(con->channel.control.notify, &n, sizeof(uint64_t)) > 0);
 
-	struct control_message *m, *n;
-	list_for_each_entry_safe(m, n, &con->channel.control.queue, l_messages) {
-		if (control_send(con, m->buf, m->len) < 0) {
-			t = -1;
-			
-			break;
-		}
+	/* producers enqueueing from now on signal the eventfd again */
+	__atomic_store_n(&q->pending, FALSE, __ATOMIC_SEQ_CST);
+
+	int t = 0;
 
-		t += m->len;
+	struct control_slot *slot;
+	while ((slot = control_queue_peek(q))) {
+		if (control_send(con, slot->buf, slot->len) < 0) return -1;
 
-		list_del(&m->l_messages);
-	
-		free(m->buf);
-		free(m);
-	}
+		t += slot->len;
 
-	while (TRUE) {
-		char b;
-		if (read(con->channel.control.notify[0], &b, 1) <= 0) break;
+		control_queue_pop(q, slot);
 	}
 
-	pthread_mutex_unlock(&con->channel.control.m_queue);
+	/* everything that overflowed was sent after what is in the ring */
+	struct list_head list;
+	control_queue_take_overflow(q, &list);
+
+	struct control_overflow *o, *_o;
+	list_for_each_entry_safe(o, _o, &list, l_overflow) {
+		if (t >= 0) t = (control_send(con, o->buf, o->len) < 0) ? -1 : t + o->len;
+
+		free(o);
+	}
 
 	return t;
 }
 
 void control_clear_queue(struct connection *con) {
-	pthread_mutex_lock(&con->channel.control.m_queue);
+	struct control_queue *q = con->channel.control.queue;
 
-	struct control_message *m, *n;
-	list_for_each_entry_safe(m, n, &con->channel.control.queue, l_messages) {
-		list_del(&m->l_messages);
+	uint64_t n;
+	while (read(con->channel.control.notify, &n, sizeof(uint64_t)) > 0);
 
-		free(m->buf);
-		free(m);
+	struct control_slot *slot;
+	while ((slot = control_queue_peek(q))) {
+		control_queue_pop(q, slot);
 	}
 
-	while (TRUE) {
-		char b;
-		if (read(con->channel.control.notify[0], &b, 1) <= 0) break;
+	struct list_head list;
+	control_queue_take_overflow(q, &list);
+
+	struct control_overflow *o, *_o;
+	list_for_each_entry_safe(o, _o, &list, l_overflow) {
+		free(o);
 	}
 
-	pthread_mutex_unlock(&con->channel.control.m_queue);
+	__atomic_store_n(&q->pending, FALSE, __ATOMIC_SEQ_CST);
 }
 
 int control_open(struct connection *con) {
@@ -387,39 +998,31 @@ int control_open(struct connection *con) {
 
 	//char buf[512];
 
-	if (!(con->channel.control.ctx = SSL_CTX_new(TLSv1_client_method()))) {
-		console_error(_CLASS, _CONTROL, "failed to create SSL context object\n");
+	if (!(con->channel.control.ctx = tls_get_context(cert))) goto print_err;
+
+	if (!(con->channel.control.ssl = SSL_new(con->channel.control.ctx))) {
+		console_error(_CLASS, _CONTROL, "failed to create SSL object\n");
 
 		goto print_err;
 	}
 
-	if (cert) {
-		if (SSL_CTX_use_certificate_file(con->channel.control.ctx, cert, SSL_FILETYPE_PEM) != 1) {
-			console_error(_CLASS, _CONTROL, "failed to load certificate from file %s\n", cert);
+	SSL_set_app_data(con->channel.control.ssl, con);
 
-			goto free_ctx;
-		}
-		if (SSL_CTX_use_PrivateKey_file(con->channel.control.ctx, cert, SSL_FILETYPE_PEM) != 1) {
-			console_error(_CLASS, _CONTROL, "failed to load private key fromf ile %s\n", cert);
+	SSL_set_tlsext_host_name(con->channel.control.ssl, host);
 
-			goto free_ctx;
-		}
-	}
-
-	if (!(con->channel.control.ssl = SSL_new(con->channel.control.ctx))) {
-		console_error(_CLASS, _CONTROL, "failed to create SSL object\n");
-
-		goto free_ctx;
-	}
+	bool resume = tls_resume_session(con->channel.control.ssl, host, port);
 
 	//SSL_set_mode(con->channel.control.ssl, SSL_MODE_AUTO_RETRY);
 
+	/* control_flush resumes interrupted writes from a buffer that may have grown (and moved) in between */
+	SSL_set_mode(con->channel.control.ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
 	struct addrinfo *result = connection_resolve_host(host, port, SOCK_STREAM, 0);
 	if (!result) {
 		goto free_ssl;
 	}
 
-	if (connection_init_socket(&con->channel.control.socket, result, FALSE, connect)) {
+	if (connection_connect(&con->channel.control.socket, result, &con->channel.control.peer.addr, &con->channel.control.peer.len)) {
 		freeaddrinfo(result);
 
 		console_error(_CLASS, _CONTROL, "failed to connect a socket to %s:%s (%s)\n", host, port, get_error_string());
@@ -429,6 +1032,10 @@ int control_open(struct connection *con) {
 
 	freeaddrinfo(result);
 
+	/* writes are coalesced by control_flush already, there is nothing to gain from Nagle */
+	int nodelay = 1;
+	setsockopt(con->channel.control.socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(int));
+
 	/*int flags = fcntl(con->channel.control.socket, F_GETFL);
 	if (flags < 0 || fcntl(con->channel.control.socket, F_SETFL, (flags | O_NONBLOCK))) {
 		printf("connection: error: failed to set socket to nonblocking I/O (%s)\n", strerror(errno));
@@ -460,33 +1067,30 @@ int control_open(struct connection *con) {
 
 		if (s > 0) break;
 
-		fd_set rfds, wfds;
-
 		int e = SSL_get_error(con->channel.control.ssl, s);
 
 		if (e == SSL_ERROR_WANT_READ) {
-			FD_ZERO(&rfds);
-			FD_SET(con->channel.control.socket, &rfds);
-			if (select(con->channel.control.socket + 1, &rfds, NULL, NULL, NULL) >= 0) {
+			if (connection_wait(con->channel.control.socket, POLLIN) >= 0) {
 				continue;
 			}
 		} else if (e == SSL_ERROR_WANT_WRITE) {
-			FD_ZERO(&wfds);
-			FD_SET(con->channel.control.socket, &wfds);
-			if (select(con->channel.control.socket + 1, NULL, &wfds, NULL, NULL) >= 0) {
+			if (connection_wait(con->channel.control.socket, POLLOUT) >= 0) {
 				continue;
 			}
 		}
 
 		save_error_string(errno);
 
+		/* a stale session must not be offered again on the next attempt */
+		if (resume) tls_drop_session(host, port);
+
 		console_lock();
 		console_error(_CLASS, _CONTROL, "failed to perform SSL/TLS handshake ");
 
 		switch (e) {
 			case SSL_ERROR_WANT_READ:
 			case SSL_ERROR_WANT_WRITE:
-				print_error("(failed to perform select on socket: %s)\n", get_error_string());
+				print_error("(failed to poll socket: %s)\n", get_error_string());
 				goto unlock_console;
 			case SSL_ERROR_ZERO_RETURN:
 				print_error("(connection closed)\n");
@@ -509,6 +1113,8 @@ int control_open(struct connection *con) {
 		}
 	} while (TRUE);
 
+	console_debug(_CLASS, _CONTROL, "%s handshake completed (%s)\n", SSL_get_version(con->channel.control.ssl), SSL_session_reused(con->channel.control.ssl) ? "session resumed" : "full handshake");
+
 	/*if (!(con->channel.control.bio = BIO_new_ssl_connect(con->channel.control.ctx))) {
 		ERR_error_string_n(ERR_get_error(), buf, 512);
 		printf("connection: error: failed to create SSL BIO chain (%s)\n", buf);
@@ -546,21 +1152,28 @@ int control_open(struct connection *con) {
 
 	con->channel.control.tid = pthread_self();
 
-	INIT_LIST_HEAD(&con->channel.control.queue);
+	con->channel.control.rx.buf = malloc(CONTROL_RX_SIZE);
+	con->channel.control.rx.size = CONTROL_RX_SIZE;
+	con->channel.control.rx.head = 0;
+	con->channel.control.rx.tail = 0;
+	con->channel.control.rx.skip = 0;
 
-	if (pipe(con->channel.control.notify)) {
-		save_error_string(errno);
-		console_error(_CLASS, _CONTROL, "failed to create notify pipe (%s)\n", get_error_string());
+	con->channel.control.tx.buf = malloc(CONTROL_TX_SIZE);
+	con->channel.control.tx.size = CONTROL_TX_SIZE;
+	con->channel.control.tx.len = 0;
+	con->channel.control.tx.off = 0;
 
-		goto close_socket;
-	}
+	if (con->channel.control.notify < 0) {
+		console_error(_CLASS, _CONTROL, "no notify eventfd available\n");
 
-	if (connection_set_nonblock(con->channel.control.notify[0]) || connection_set_nonblock(con->channel.control.notify[1])) {
-		console_error(_CLASS, _CONTROL, "failed to set notify pipe nonblocking (%s)\n", get_error_string());
+		free(con->channel.control.tx.buf);
+		free(con->channel.control.rx.buf);
 
 		goto close_socket;
 	}
 
+	control_clear_queue(con);
+
 	//pthread_mutex_init(&con->channel.control.queue_m, NULL);
 
 	return 0;
@@ -577,9 +1190,6 @@ int control_open(struct connection *con) {
 	free_ssl:
 	SSL_free(con->channel.control.ssl);
 
-	free_ctx:
-	SSL_CTX_free(con->channel.control.ctx);
-
 	print_err:
 	/*ERR_error_string_n(ERR_get_error(), buf, 512);
 	printf(" (%s)\n", buf);*/
@@ -596,25 +1206,22 @@ int control_open(struct connection *con) {
 void control_close(struct connection *con) {
 	if (!pthread_equal(pthread_self(), con->channel.control.tid)) return;
 
+	/* best effort, whatever does not fit into the socket buffer right now is lost */
+	control_flush(con);
+
 	//BIO_free_all(con->channel.control.bio);
 	//SSL_shutdown(con->channel.control.ssl);
 	do {
 		int s = SSL_shutdown(con->channel.control.ssl);
 
-		fd_set rfds, wfds;
-
 		int e = SSL_get_error(con->channel.control.ssl, s);
 
 		if (e == SSL_ERROR_WANT_READ) {
-			FD_ZERO(&rfds);
-			FD_SET(con->channel.control.socket, &rfds);
-			if (select(con->channel.control.socket + 1, &rfds, NULL, NULL, NULL) >= 0) {
+			if (connection_wait(con->channel.control.socket, POLLIN) >= 0) {
 				continue;
 			}
 		} else if (e == SSL_ERROR_WANT_WRITE) {
-			FD_ZERO(&wfds);
-			FD_SET(con->channel.control.socket, &wfds);
-			if (select(con->channel.control.socket + 1, NULL, &wfds, NULL, NULL) >= 0) {
+			if (connection_wait(con->channel.control.socket, POLLOUT) >= 0) {
 				continue;
 			}
 		}
@@ -629,20 +1236,31 @@ void control_close(struct connection *con) {
 
 	SSL_free(con->channel.control.ssl);
 
-	SSL_CTX_free(con->channel.control.ctx);
+	/* the context is shared and kept until openssl_cleanup */
 
 	con->channel.control.connected = FALSE;
 
 	control_clear_queue(con);
 
-	close(con->channel.control.notify[0]);
-	close(con->channel.control.notify[1]);
+	free(con->channel.control.rx.buf);
+
+	free(con->channel.control.tx.buf);
+
+	arena_reset(con->channel.control.arena);
 
 	//pthread_mutex_destroy(&con->channel.control.queue_m);
 
 	ERR_remove_state(0);
 }
 
+/* only the first producer after a flush has to wake up the engine */
+static void control_queue_notify(struct connection *con) {
+	if (!__atomic_exchange_n(&con->channel.control.queue->pending, TRUE, __ATOMIC_SEQ_CST)) {
+		uint64_t n = 1;
+		write(con->channel.control.notify, &n, sizeof(uint64_t));
+	}
+}
+
 int control_send(struct connection *con, void *buf, int len) {
 	/*int s, t;
 
@@ -660,162 +1278,163 @@ int control_send(struct connection *con, void *buf, int len) {
 
 	return s > 0 ? s : -1;*/
 
-	if (pthread_equal(pthread_self(), con->channel.control.tid)) {
-		int s, t = 0;
+	unsigned char *tx = control_reserve(con, len);
 
-		fd_set rfds, wfds;
+	if (tx) {
+		/* written out by control_flush once the engine is done dispatching */
+		memcpy(tx, buf, len);
+		control_commit(con, len);
 
-		do {
-			ERR_clear_error();
+		return len;
+	} else {
+		if (!con->channel.control.connected) return -1;
 
-			s = SSL_write(con->channel.control.ssl, buf + t, len - t);
+		control_queue_push(con->channel.control.queue, buf, len);
 
-			/* partial writes are disabled, so this is actually not necessary */
-			if (s > 0) {
-				t += s;
+		control_queue_notify(con);
 
-				continue;
-			}
+		return len;
+	}
+}
 
-			int e = SSL_get_error(con->channel.control.ssl, s);
+/*
+ * lets a producer off the engine thread build tunneled audio right inside a
+ * send queue slot: slot->buf offers CONTROL_SLOT_SIZE bytes and may be
+ * replaced by a malloc'd buffer for larger packets; every reserved slot has to
+ * be passed to control_queue_commit, with a length of 0 if nothing is to be sent
+ */
+struct control_slot * control_queue_reserve(struct connection *con) {
+	if (!con->channel.control.connected) return NULL;
 
-			if (e == SSL_ERROR_WANT_READ) {
-				FD_ZERO(&rfds);
-				FD_SET(con->channel.control.socket, &rfds);
-				if (select(con->channel.control.socket + 1, &rfds, NULL, NULL, NULL) > 0) {
-					continue;
-				}
-			} else if (e == SSL_ERROR_WANT_WRITE) {
-				FD_ZERO(&wfds);
-				FD_SET(con->channel.control.socket, &wfds);
-				if (select(con->channel.control.socket + 1, NULL, &wfds, NULL, NULL) > 0) {
-					continue;
-				}
-			} else if (e == SSL_ERROR_SYSCALL && s == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-				FD_ZERO(&wfds);
-				FD_SET(con->channel.control.socket, &wfds);
-				if (select(con->channel.control.socket + 1, NULL, &wfds, NULL, NULL) > 0) {
-					continue;
-				}
-			}
+	/* audio is late by the time the queue backs up, so it is dropped rather than overflowing */
+	struct control_slot *slot = control_queue_claim(con->channel.control.queue);
+	if (!slot) {
+		console_warning(_CLASS, _CONTROL, "send queue is full, dropping audio\n");
 
-			return -1;
-		} while (t < len);
+		return NULL;
+	}
 
-		return t;
-	} else {
-		pthread_mutex_lock(&con->channel.control.m_queue);
+	slot->buf = slot->data;
 
-		if (!con->channel.control.connected) {
-			pthread_mutex_unlock(&con->channel.control.m_queue);
+	return slot;
+}
 
-			return -1;
-		}
+void control_queue_commit(struct connection *con, struct control_slot *slot, int len) {
+	slot->len = len;
 
-		struct control_message *m = malloc(sizeof(struct control_message));
+	control_queue_publish(slot);
 
-		m->buf = malloc(len);
-		memcpy(m->buf, buf, len);
-		m->len = len;
+	control_queue_notify(con);
+}
 
-		list_add_tail(&m->l_messages, &con->channel.control.queue);
+/*
+ * returns room for len bytes at the end of the write buffer, the data is
+ * appended by control_commit; only valid on the engine thread
+ */
+unsigned char * control_reserve(struct connection *con, int len) {
+	if (!con->channel.control.connected || !pthread_equal(pthread_self(), con->channel.control.tid)) return NULL;
 
-		char b = 0xFF;
-		write(con->channel.control.notify[1], &b, 1);
+	int size = con->channel.control.tx.size;
 
-		pthread_mutex_unlock(&con->channel.control.m_queue);
+	while (con->channel.control.tx.len + len > size) size *= 2;
 
-		return len;
+	if (size != con->channel.control.tx.size) {
+		con->channel.control.tx.buf = realloc(con->channel.control.tx.buf, size);
+		con->channel.control.tx.size = size;
 	}
+
+	return con->channel.control.tx.buf + con->channel.control.tx.len;
 }
 
-int control_recv(struct connection *con, void *buf, int len) {
-	/*int r = BIO_read(con->channel.control.bio, buf, len);
+void control_commit(struct connection *con, int len) {
+	con->channel.control.tx.len += len;
+}
 
-	return r > 0 ? r : -1;*/
+/*
+ * writes everything appended since the last flush with as few SSL_write calls
+ * as possible; returns the number of bytes still pending because the socket
+ * would block (the caller has to wait for POLLOUT) or -1 on failure
+ */
+int control_flush(struct connection *con) {
+	int pending = con->channel.control.tx.len - con->channel.control.tx.off;
 
-	/*int r = SSL_read(con->channel.control.ssl, buf, len);
+	if (!pending) return 0;
 
-	return r > 0 ? r : -1;*/
-	
-	if (!pthread_equal(pthread_self(), con->channel.control.tid)) return -1;
+	/* more than one record's worth of data, let the kernel fill up segments */
+	bool cork = pending > SSL3_RT_MAX_PLAIN_LENGTH;
 
-	int r, s, t = 0;
+	if (cork) {
+		int on = 1;
+		setsockopt(con->channel.control.socket, IPPROTO_TCP, TCP_CORK, &on, sizeof(int));
+	}
 
-	fd_set rfds, wfds;
+	while (pending) {
+		ERR_clear_error();
 
-	if (!(r = SSL_pending(con->channel.control.ssl))) {
-		struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+		int s = SSL_write(con->channel.control.ssl, con->channel.control.tx.buf + con->channel.control.tx.off, pending);
 
-		FD_ZERO(&rfds);
-		FD_SET(con->channel.control.socket, &rfds);
-		FD_SET(con->channel.control.notify[0], &rfds);
-		FD_SET(con->channel.voice.socket, &rfds);
+		if (s > 0) {
+			con->channel.control.tx.off += s;
+			pending -= s;
+
+			continue;
+		}
 
-		int nfds = max(con->channel.control.socket, con->channel.control.notify[0]);
-		nfds = max(nfds, con->channel.voice.socket);
-		nfds++;
+		int e = SSL_get_error(con->channel.control.ssl, s);
 
-		r = select(nfds, &rfds, NULL, NULL, &tv);
+		if (e == SSL_ERROR_WANT_READ || e == SSL_ERROR_WANT_WRITE || (e == SSL_ERROR_SYSCALL && s == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))) break;
 
-		if (FD_ISSET(con->channel.control.notify[0], &rfds)) {
-			/*while (TRUE) {
-				char b;
-				if (read(con->channel.control.notify[0], &b, 1) <= 0) break;
-			}*/
-			r--;
-		}
+		console_error(_CLASS, _CONTROL, "failed to write to control channel\n");
 
-		if (FD_ISSET(con->channel.voice.socket, &rfds)) {
-			r--;
-		}
+		pending = -1;
+
+		break;
 	}
 
-	if (r > 0) {
-		do {
-			ERR_clear_error();
+	if (cork) {
+		int off = 0;
+		setsockopt(con->channel.control.socket, IPPROTO_TCP, TCP_CORK, &off, sizeof(int));
+	}
 
-			s = SSL_read(con->channel.control.ssl, buf + t, len - t);
+	if (!pending) {
+		con->channel.control.tx.len = 0;
+		con->channel.control.tx.off = 0;
+	}
 
-			if (s > 0) {
-				t += s;
+	return pending;
+}
 
-				continue;
-			}
+int control_recv(struct connection *con, void *buf, int len) {
+	/*int r = BIO_read(con->channel.control.bio, buf, len);
 
-			int e = SSL_get_error(con->channel.control.ssl, s);
+	return r > 0 ? r : -1;*/
 
-			if (e == SSL_ERROR_WANT_READ) {
-				FD_ZERO(&rfds);
-				FD_SET(con->channel.control.socket, &rfds);
-				if (select(con->channel.control.socket + 1, &rfds, NULL, NULL, NULL) > 0) {
-					continue;
-				}
-			} else if (e == SSL_ERROR_WANT_WRITE) {
-				FD_ZERO(&wfds);
-				FD_SET(con->channel.control.socket, &wfds);
-				if (select(con->channel.control.socket + 1, NULL, &wfds, NULL, NULL) > 0) {
-					continue;
-				}
-			} else if (e == SSL_ERROR_SYSCALL && s == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-				FD_ZERO(&rfds);
-				FD_SET(con->channel.control.socket, &rfds);
-				if (select(con->channel.control.socket + 1, &rfds, NULL, NULL, NULL) > 0) {
-					continue;
-				}
-			}
+	/*
+	 * the socket is driven by the engine's reactor, so we never wait here; a
+	 * return value of 0 means no (more) data is available right now
+	 */
+	
+	if (!pthread_equal(pthread_self(), con->channel.control.tid)) return -1;
 
-			if (s == 0) {
-				console_message(_CLASS, _CONTROL, "connection shutdown by peer %s:%s\n", con->host, con->port);
-			}
+	ERR_clear_error();
 
-			return -1;
-		} while (t < len);
+	int s = SSL_read(con->channel.control.ssl, buf, len);
+
+	if (s > 0) return s;
+
+	int e = SSL_get_error(con->channel.control.ssl, s);
+
+	if (e == SSL_ERROR_WANT_READ || e == SSL_ERROR_WANT_WRITE) {
+		return 0;
+	} else if (e == SSL_ERROR_SYSCALL && s == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return 0;
+	}
 
-		return t;
+	if (s == 0 || e == SSL_ERROR_ZERO_RETURN) {
+		console_message(_CLASS, _CONTROL, "connection shutdown by peer %s:%s\n", con->host, con->port);
 	}
 
-	return r;
+	return -1;
 }
 
 int voice_open(struct connection *con) {
@@ -856,26 +1475,29 @@ int voice_open(struct connection *con) {
 
 	con->channel.voice.remote.sin_port = htons(atoi(con->port));*/
 
-	struct addrinfo *result = connection_resolve_host(NULL, "0", SOCK_DGRAM, AI_PASSIVE);
-	if (!result) goto err;
+	/* the server's UDP port equals its TCP port, so the address the control channel is connected to is reused */
+	memcpy(&con->channel.voice.remote.addr, &con->channel.control.peer.addr, con->channel.control.peer.len);
+	con->channel.voice.remote.len = con->channel.control.peer.len;
 
-	if (connection_init_socket(&con->channel.voice.socket, result, FALSE, bind)) {
-		freeaddrinfo(result);
+	struct sockaddr_storage local;
+	memset(&local, 0, sizeof(struct sockaddr_storage));
+	local.ss_family = con->channel.voice.remote.addr.ss_family;
 
-		console_error(_CLASS, _VOICE, "failed to bind a socket for UDP traffic to %s:%s (%s)\n", con->host, con->port, get_error_string());
+	socklen_t local_len = (local.ss_family == AF_INET6) ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+
+	if ((con->channel.voice.socket = socket(local.ss_family, SOCK_DGRAM, 0)) < 0) {
+		save_error_string(errno);
+		console_error(_CLASS, _VOICE, "failed to create a socket for UDP traffic to %s:%s (%s)\n", con->host, con->port, get_error_string());
 
 		goto err;
 	}
 
-	freeaddrinfo(result);
-
-	result = connection_resolve_host(con->host, con->port, SOCK_DGRAM, 0);
-	if (!result) goto close_socket;
-
-	memcpy(&con->channel.voice.remote.addr,  result->ai_addr, result->ai_addrlen);
-	con->channel.voice.remote.len = result->ai_addrlen;
+	if (connection_set_nonblock(con->channel.voice.socket) || bind(con->channel.voice.socket, (struct sockaddr *) &local, local_len)) {
+		save_error_string(errno);
+		console_error(_CLASS, _VOICE, "failed to bind a socket for UDP traffic to %s:%s (%s)\n", con->host, con->port, get_error_string());
 
-	freeaddrinfo(result);
+		goto close_socket;
+	}
 
 	con->channel.voice.enabled = FALSE;
 	con->channel.voice.transmit_position = FALSE;
@@ -885,9 +1507,26 @@ int voice_open(struct connection *con) {
 	con->channel.voice.ping.s = 0;
 	con->channel.voice.ping.var = 0.0;
 
-	con->channel.voice.crypt.init = FALSE;
+	struct voice_queue *q = con->channel.voice.queue;
 
-	pthread_mutex_init(&con->channel.voice.m_crypt, NULL);
+	pthread_mutex_lock(&q->m_queue);
+
+	q->n = 0;
+	q->armed = FALSE;
+	q->flushes = 0;
+	q->datagrams = 0;
+
+	q->timer = reactor_timer_open(0);
+
+	pthread_mutex_unlock(&q->m_queue);
+
+	if (q->timer < 0) goto close_socket;
+
+	con->channel.voice.rx.wakeups = 0;
+	con->channel.voice.rx.datagrams = 0;
+	con->channel.voice.rx.max = 0;
+
+	crypt_reset(&con->channel.voice.crypt);
 
 	con->channel.voice.connected = TRUE;
 
@@ -901,129 +1540,155 @@ int voice_open(struct connection *con) {
 }
 
 void voice_close(struct connection *con) {
+	struct voice_queue *q = con->channel.voice.queue;
+
+	/* producers check connected again under m_queue, so none of them touches the socket or the timer past this point */
+	pthread_mutex_lock(&q->m_queue);
+
 	con->channel.voice.connected = FALSE;
 
+	q->n = 0;
+	q->armed = FALSE;
+
+	close(q->timer);
+	q->timer = -1;
+
+	pthread_mutex_unlock(&q->m_queue);
+
 	// might need to shutdown()
 	shutdown(con->channel.voice.socket, SHUT_RDWR);
 
 	close(con->channel.voice.socket);
 
-	pthread_mutex_destroy(&con->channel.voice.m_crypt);
-}
-
-int voice_send(struct connection *con, unsigned char *buf, int len) {
-	udp_buffer dgram;
-
-	if (!con->channel.voice.connected) return -1;
+	if (q->flushes) {
+		console_message(_CLASS, _VOICE, "sent %llu datagrams in %llu flushes\n", q->datagrams, q->flushes);
+	}
 
-	if (!con->channel.voice.crypt.init) return 0;
+	if (con->channel.voice.rx.wakeups) {
+		console_message(_CLASS, _VOICE, "received %llu datagrams in %llu wakeups (%.1f on average, %i at most)\n", con->channel.voice.rx.datagrams, con->channel.voice.rx.wakeups, (double) con->channel.voice.rx.datagrams / con->channel.voice.rx.wakeups, con->channel.voice.rx.max);
+	}
 
-	pthread_mutex_lock(&con->channel.voice.m_crypt);
+	crypt_free(&con->channel.voice.crypt);
+}
 
-	crypt_encrypt(&con->channel.voice.crypt, buf, dgram, len);
+static int voice_flush_queue_locked(struct connection *con, struct voice_queue *q) {
+	struct mmsghdr msgs[VOICE_QUEUE_SIZE];
+	struct iovec iov[VOICE_QUEUE_SIZE];
 
-	pthread_mutex_unlock(&con->channel.voice.m_crypt);
+	int i;
+	for (i = 0; i < q->n; i++) {
+		iov[i].iov_base = q->dgram[i];
+		iov[i].iov_len = q->len[i];
+
+		memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+		msgs[i].msg_hdr.msg_name = &con->channel.voice.remote.addr;
+		msgs[i].msg_hdr.msg_namelen = con->channel.voice.remote.len;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
 
 	int t = 0;
 
-	do {
-		fd_set wfds;
-		FD_ZERO(&wfds);
-		FD_SET(con->channel.voice.socket, &wfds);
-
-		int r = select(con->channel.voice.socket + 1, NULL, &wfds, NULL, NULL);
+	while (t < q->n) {
+		int s = sendmmsg(con->channel.voice.socket, msgs + t, q->n - t, 0);
 
-		if (r <= 0) return -1;
+		if (s < 0) {
+			if (errno == EINTR) continue;
 
-		int s = sendto(con->channel.voice.socket, dgram + t, len + CRYPT_HEADER_SIZE - t, 0, &con->channel.voice.remote.addr, con->channel.voice.remote.len);
-
-		if (s > 0) {
-			t += s;
+			/* voice is useless once it is late, so we do not wait for the socket */
+			console_debug(_CLASS, _VOICE, "dropping %i datagrams (%s)\n", q->n - t, strerror(errno));
 
-			continue;
+			break;
 		}
 
-		if (s < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+		t += s;
+	}
 
-		return -1;
+	q->flushes++;
+	q->datagrams += t;
 
-	} while (t < len);
+	q->n = 0;
 
 	return t;
 }
 
-int voice_recv(struct connection *con, unsigned char *buf) {
-	udp_buffer dgram;
-
-	/*if (!con->channel.voice.crypt.init) {
-		sleep(1); // meh
-		return 0;
-	}*/
+/*
+ * sends all datagrams queued up by voice_send with a single system call;
+ * called once per audio tick by the engine
+ */
+int voice_flush_queue(struct connection *con) {
+	struct voice_queue *q = con->channel.voice.queue;
 
-	struct sockaddr remote;
-	socklen_t remote_len = sizeof(struct sockaddr);
+	pthread_mutex_lock(&q->m_queue);
 
-	struct timeval tv;
+	int t = voice_flush_queue_locked(con, q);
 
-	fd_set rfds;
-	FD_ZERO(&rfds);
+	q->armed = FALSE;
 
-	int nfds;
+	pthread_mutex_unlock(&q->m_queue);
 
-	int r;
+	return t;
+}
 
-	if (SSL_pending(con->channel.control.ssl)) {
-		tv = (struct timeval) { .tv_sec = 0, .tv_usec = 0 };
+/*
+ * encrypts a packet into the outbound queue; the queue is flushed at the next
+ * audio tick, or right away if it is full
+ */
+int voice_send(struct connection *con, unsigned char *buf, int len) {
+	if (!con->channel.voice.connected) return -1;
 
-		FD_SET(con->channel.voice.socket, &rfds);
+	if (!con->channel.voice.crypt.init) return 0;
 
-		nfds = con->channel.voice.socket + 1;
+	if (len + CRYPT_HEADER_SIZE > UDP_BUFFER_SIZE) return -1;
 
-		r = select(nfds, &rfds, NULL, NULL, &tv);
-	} else {
-		tv = (struct timeval) { .tv_sec = 1, .tv_usec = 0 };
+	/* producers encrypt in parallel, only the copy into the queue is serialized */
+	udp_buffer dgram;
 
-		FD_SET(con->channel.voice.socket, &rfds);
-		FD_SET(con->channel.control.socket, &rfds);
-		FD_SET(con->channel.control.notify[0], &rfds);
+	crypt_encrypt(&con->channel.voice.crypt, buf, dgram, len);
 
-		nfds = max(con->channel.voice.socket, con->channel.control.socket);
-		nfds = max(nfds, con->channel.control.notify[0]);
-		nfds++;
+	struct voice_queue *q = con->channel.voice.queue;
 
-		r = select(nfds, &rfds, NULL, NULL, &tv);
+	pthread_mutex_lock(&q->m_queue);
 
-		if (FD_ISSET(con->channel.control.socket, &rfds)) r--;
+	if (!con->channel.voice.connected) {
+		pthread_mutex_unlock(&q->m_queue);
 
-		if (FD_ISSET(con->channel.control.notify[0], &rfds)) r--;
+		return -1;
 	}
 
-	if (r <= 0) return r;
+	if (q->n == VOICE_QUEUE_SIZE) voice_flush_queue_locked(con, q);
 
-	int n = recvfrom(con->channel.voice.socket, dgram, UDP_BUFFER_SIZE, 0, &remote, &remote_len);
+	memcpy(q->dgram[q->n], dgram, len + CRYPT_HEADER_SIZE);
+	q->len[q->n++] = len + CRYPT_HEADER_SIZE;
 
-	if (n < 0) {
-		return -1;
-	} else if (n == 0) {
-		console_message(_CLASS, _VOICE, "connection shutdown by peer %s:%s\n", con->host, con->port);
+	if (!q->armed) {
+		q->armed = (reactor_timer_arm_tick(q->timer, VOICE_TICK) == 0);
 
-		return -1;
+		if (!q->armed) voice_flush_queue_locked(con, q);
 	}
 
-	if (connection_compare_hosts(&remote, remote_len, &con->channel.voice.remote.addr, con->channel.voice.remote.len, 0)) {
-		return 0;
+	pthread_mutex_unlock(&q->m_queue);
+
+	return len;
+}
+
+static bool voice_decrypt(struct connection *con, const unsigned char *dgram, int n, struct sockaddr *remote, socklen_t remote_len, unsigned char *buf) {
+	if (n <= 0) {
+		return FALSE;
+	}
+
+	if (connection_compare_hosts(remote, (struct sockaddr *) &con->channel.voice.remote.addr)) {
+		return FALSE;
 	}
 
 	if (!con->channel.voice.crypt.init) {
-		return 0;
+		return FALSE;
 	}
 
 	if (n <= CRYPT_HEADER_SIZE) {
-		return 0;
+		return FALSE;
 	}
 
-	//pthread_mutex_lock(&con->channel.voice.m_crypt);
-
 	if (!crypt_decrypt(&con->channel.voice.crypt, dgram, buf, n)) {
 		if (timer_elapsed(&con->channel.voice.crypt.last_good) > 5000ULL) {
 			if (timer_elapsed(&con->channel.voice.crypt.last_request) > 5000ULL) {
@@ -1032,14 +1697,86 @@ int voice_recv(struct connection *con, unsigned char *buf) {
 			}
 		}
 
-		//pthread_mutex_unlock(&con->channel.voice.m_crypt);
+		return FALSE;
+	}
 
-		return 0;
+	return TRUE;
+}
+
+int voice_recv(struct connection *con, unsigned char *buf) {
+	udp_buffer dgram;
+
+	/*
+	 * returns the length of the next valid datagram, 0 once the socket has been
+	 * drained or -1 on error; datagrams we cannot use are skipped
+	 */
+
+	while (TRUE) {
+		struct sockaddr_storage remote;
+		socklen_t remote_len = sizeof(struct sockaddr_storage);
+
+		int n = recvfrom(con->channel.voice.socket, dgram, UDP_BUFFER_SIZE, 0, (struct sockaddr *) &remote, &remote_len);
+
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			if (errno == EINTR) continue;
+
+			return -1;
+		}
+
+		if (voice_decrypt(con, dgram, n, (struct sockaddr *) &remote, remote_len, buf)) {
+			return n - CRYPT_HEADER_SIZE;
+		}
 	}
+}
+
+/*
+ * pulls up to VOICE_BATCH_SIZE datagrams with a single system call and
+ * decrypts all of them; b->n is set to the number of usable packets, the
+ * return value is the number of datagrams read from the socket
+ */
+int voice_recv_batch(struct connection *con, struct voice_batch *b) {
+	struct mmsghdr msgs[VOICE_BATCH_SIZE];
+	struct iovec iov[VOICE_BATCH_SIZE];
+
+	int i;
+	for (i = 0; i < VOICE_BATCH_SIZE; i++) {
+		iov[i].iov_base = b->dgram[i];
+		iov[i].iov_len = UDP_BUFFER_SIZE;
+
+		memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+		msgs[i].msg_hdr.msg_name = &b->remote[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	b->n = 0;
+
+	int n;
+	do {
+		n = recvmmsg(con->channel.voice.socket, msgs, VOICE_BATCH_SIZE, MSG_DONTWAIT, NULL);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0) {
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (voice_decrypt(con, b->dgram[i], msgs[i].msg_len, (struct sockaddr *) &b->remote[i], msgs[i].msg_hdr.msg_namelen, b->packet[b->n])) {
+			b->len[b->n++] = msgs[i].msg_len - CRYPT_HEADER_SIZE;
+		}
+	}
+
+	return n;
+}
 
-	//pthread_mutex_unlock(&con->channel.voice.m_crypt);
+void voice_account_wakeup(struct connection *con, int n) {
+	con->channel.voice.rx.wakeups++;
+	con->channel.voice.rx.datagrams += n;
+	if (n > con->channel.voice.rx.max) con->channel.voice.rx.max = n;
 
-	return n - CRYPT_HEADER_SIZE;
+	console_debug(_CLASS, _VOICE, "pulled %i datagrams (%llu datagrams in %llu wakeups)\n", n, con->channel.voice.rx.datagrams, con->channel.voice.rx.wakeups);
 }
 
 /*int connection_open(struct connection *con) {
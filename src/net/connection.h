@@ -5,6 +5,7 @@
 #include <pthread.h>
 #include <sys/socket.h>
 
+#include "../arena.h"
 #include "crypt.h"
 #include "../list.h"
 #include "../timer.h"
@@ -14,10 +15,75 @@
 
 typedef unsigned char udp_buffer[UDP_BUFFER_SIZE];
 
-struct control_message {
-	void *buf;
+#define VOICE_BATCH_SIZE 32
+
+struct voice_batch {
+	int n;
+	int len[VOICE_BATCH_SIZE];
+	udp_buffer packet[VOICE_BATCH_SIZE];
+	udp_buffer dgram[VOICE_BATCH_SIZE];
+	struct sockaddr_storage remote[VOICE_BATCH_SIZE];
+};
+
+#define VOICE_QUEUE_SIZE 64
+
+#define VOICE_TICK 10000ULL
+
+struct voice_queue {
+	int n;
+	int len[VOICE_QUEUE_SIZE];
+	udp_buffer dgram[VOICE_QUEUE_SIZE];
+	int timer;
+	bool armed;
+	pthread_mutex_t m_queue;
+	uint64_t flushes;
+	uint64_t datagrams;
+};
+
+#define CONTROL_TX_SIZE 4096
+
+#define CONTROL_RX_SIZE 16384
+
+#define CONTROL_ARENA_SIZE 65536
+
+#define CONTROL_QUEUE_SIZE 128
+
+#define CONTROL_SLOT_SIZE 512
+
+#define CACHE_LINE_SIZE 64
+
+/* messages larger than CONTROL_SLOT_SIZE are stored on the heap, buf points to either */
+struct control_slot {
+	uint64_t sequence;
+	int len;
+	unsigned char *buf;
+	unsigned char data[CONTROL_SLOT_SIZE];
+};
+
+/* a message that found the send queue full */
+struct control_overflow {
+	struct list_head l_overflow;
 	int len;
-	struct list_head l_messages;
+	unsigned char buf[];
+};
+
+/*
+ * bounded lock-free queue (after Dmitry Vyukov) for messages sent from threads
+ * other than the engine; any thread may enqueue, only the engine dequeues
+ *
+ * once the ring is full, messages go to the overflow list instead and keep
+ * doing so until the engine has drained it, so nothing is lost or reordered
+ */
+struct control_queue {
+	uint64_t head;
+	unsigned char pad_head[CACHE_LINE_SIZE - sizeof(uint64_t)];
+	uint64_t tail;
+	unsigned char pad_tail[CACHE_LINE_SIZE - sizeof(uint64_t)];
+	bool pending;
+	struct control_slot slot[CONTROL_QUEUE_SIZE];
+	int overflowed;
+	struct list_head overflow;
+	pthread_mutex_t m_overflow;
 };
 
 struct ping {
@@ -25,6 +91,16 @@ struct ping {
 	float avg;
 	unsigned int s;
 	float var;
+	/* smoothed round trip time and its deviation, following recent samples */
+	float srtt;
+	float rttvar;
+};
+
+/* packet counters as of the last adaptation step */
+struct audio_stats {
+	uint32_t good;
+	uint32_t late;
+	uint32_t lost;
 };
 
 struct connection {
@@ -38,6 +114,14 @@ struct connection {
 		} celt;*/
 		int bitrate;
 		int frames;
+		/* configured quality, adaptation never goes beyond it */
+		int max_bitrate;
+		int min_frames;
+		struct {
+			struct audio_stats tx;
+			struct audio_stats rx;
+			int stable;
+		} adapt;
 	} audio;
 	pthread_mutex_t m_audio;
 	struct timer timestamp;
@@ -52,9 +136,28 @@ struct connection {
 			//BIO *bio;
 			SSL *ssl;
 			int socket;
-			struct list_head queue;
-			pthread_mutex_t m_queue;
-			int notify[2];
+			struct {
+				struct sockaddr_storage addr;
+				socklen_t len;
+			} peer;
+			struct control_queue *queue;
+			int notify;
+			struct {
+				unsigned char *buf;
+				int size;
+				int len;
+				int off;
+			} tx;
+			struct {
+				unsigned char *buf;
+				int size;
+				int head;
+				int tail;
+				/* body bytes of an unhandled message still to be dropped */
+				int skip;
+			} rx;
+			/* backs unpacked messages until the engine's next iteration */
+			struct arena *arena;
 			struct ping ping;
 		} control;
 		struct {
@@ -63,12 +166,18 @@ struct connection {
 			bool transmit_position;
 			int socket;
 			struct {
-				struct sockaddr addr;
+				struct sockaddr_storage addr;
 				socklen_t len;
 			} remote;
 			struct crypt crypt;
-			pthread_mutex_t m_crypt;
 			struct ping ping;
+			struct voice_batch *batch;
+			struct voice_queue *queue;
+			struct {
+				uint64_t wakeups;
+				uint64_t datagrams;
+				int max;
+			} rx;
 		} voice;
 	} channel;
 };
@@ -83,12 +192,16 @@ void connection_free(struct connection *);
 
 void connection_update_ping(struct connection *, struct ping *, uint64_t);
 
+void connection_get_ping(struct connection *, struct ping *, struct ping *);
+
 //int connection_get_bandwidth(struct connection *);
 
 //void connectin_adjust_bandwidth(struct connection *);
 
 void connection_set_max_bandwidth(struct connection *, int);
 
+void connection_adapt_audio(struct connection *, uint32_t, uint32_t, uint32_t);
+
 //int connection_get_celt_codec_version(struct connection *, int *);
 
 //void connection_set_celt_codec_version(struct connection *, int, int, int);
@@ -97,16 +210,22 @@ int connection_get_bitrate(struct connection *);
 
 int connection_get_frames(struct connection *);
 
-int control_flush_queue(struct connection *);
-
-void control_clear_queue(struct connection *);
-
 int control_open(struct connection *);
 
 void control_close(struct connection *);
 
 int control_send(struct connection *, void *, int);
 
+unsigned char * control_reserve(struct connection *, int);
+
+void control_commit(struct connection *, int);
+
+struct control_slot * control_queue_reserve(struct connection *);
+
+void control_queue_commit(struct connection *, struct control_slot *, int);
+
+int control_flush(struct connection *);
+
 int control_flush_queue(struct connection *);
 
 void control_clear_queue(struct connection *);
@@ -119,8 +238,14 @@ void voice_close(struct connection *);
 
 int voice_send(struct connection *, unsigned char *, int);
 
+int voice_flush_queue(struct connection *);
+
 int voice_recv(struct connection *, unsigned char *);
 
+int voice_recv_batch(struct connection *, struct voice_batch *);
+
+void voice_account_wakeup(struct connection *, int);
+
 //int connection_open(struct connection *);
 
 //void connection_shutdown(struct connection *);
@@ -1,26 +1,240 @@
 #include <arpa/inet.h>
 #include <openssl/aes.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "../console.h"
 #include "crypt.h"
 #include "../timer.h"
 #include "../types.h"
 
-void crypt_init(struct crypt *c, const unsigned char *key, const unsigned char *eiv, const unsigned char *div) {
+#define _CLASS "crypt"
+
+static bool crypt_has_aesni() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+
+	return __builtin_cpu_supports("aes") != 0;
+#else
+	return FALSE;
+#endif
+}
+
+static EVP_CIPHER_CTX * crypt_evp_init(EVP_CIPHER_CTX *ctx, const unsigned char *key, bool encrypt) {
+	if (!ctx && !(ctx = EVP_CIPHER_CTX_new())) return NULL;
+
+	if (EVP_CipherInit_ex(ctx, EVP_aes_128_ecb(), NULL, key, NULL, encrypt ? 1 : 0) != 1) {
+		EVP_CIPHER_CTX_free(ctx);
+
+		return NULL;
+	}
+
+	EVP_CIPHER_CTX_set_padding(ctx, 0);
+
+	return ctx;
+}
+
+/* identifies key generations across all connections, see crypt_get_cipher */
+static uint64_t crypt_keys = 0;
+
+/*
+ * EVP contexts must not be shared between threads, so every sending thread
+ * keeps one of its own and rekeys it lazily when it sees a new generation
+ */
+struct crypt_cipher {
+	uint64_t id;
+	EVP_CIPHER_CTX *ctx;
+};
+
+static pthread_key_t crypt_cipher_key;
+static pthread_once_t crypt_cipher_once = PTHREAD_ONCE_INIT;
+
+static void crypt_cipher_free(void *arg) {
+	struct crypt_cipher *cc = (struct crypt_cipher *) arg;
+
+	if (cc->ctx) EVP_CIPHER_CTX_free(cc->ctx);
+
+	free(cc);
+}
+
+static void crypt_cipher_key_create() {
+	pthread_key_create(&crypt_cipher_key, crypt_cipher_free);
+}
+
+static EVP_CIPHER_CTX * crypt_get_cipher(struct crypt_key *k) {
+	pthread_once(&crypt_cipher_once, crypt_cipher_key_create);
+
+	struct crypt_cipher *cc = (struct crypt_cipher *) pthread_getspecific(crypt_cipher_key);
+	if (!cc) {
+		cc = malloc(sizeof(struct crypt_cipher));
+
+		cc->id = 0;
+		cc->ctx = NULL;
+
+		pthread_setspecific(crypt_cipher_key, cc);
+	}
+
+	if (cc->id != k->id) {
+		if (!(cc->ctx = crypt_evp_init(cc->ctx, k->key, TRUE))) {
+			cc->id = 0;
+
+			return NULL;
+		}
+
+		cc->id = k->id;
+	}
+
+	return cc->ctx;
+}
+
+/* nonces are little-endian 128 bit counters */
+static void crypt_iv_add(unsigned char *dst, const unsigned char *iv, uint64_t n) {
+	unsigned int carry = 0;
+
 	int i;
-	for (i = 0; i < 0x100; i++) {
-		c->decrypt_history[i] = 0;
+	for (i = 0; i < AES_BLOCK_SIZE; i++) {
+		unsigned int sum = iv[i] + (n & 0xFF) + carry;
+
+		dst[i] = sum & 0xFF;
+		carry = sum >> 8;
+		n >>= 8;
+	}
+}
+
+/* pins the current generation, the caller has to drop readers when done */
+static struct crypt_key * crypt_key_acquire(struct crypt_encrypt_context *tx) {
+	while (TRUE) {
+		uint32_t g = __atomic_load_n(&tx->generation, __ATOMIC_SEQ_CST);
+
+		struct crypt_key *k = &tx->slot[g & 1];
+
+		__atomic_add_fetch(&k->readers, 1, __ATOMIC_SEQ_CST);
+
+		/* a rekey might have started on this slot in the meantime */
+		if (__atomic_load_n(&tx->generation, __ATOMIC_SEQ_CST) == g) return k;
+
+		__atomic_sub_fetch(&k->readers, 1, __ATOMIC_SEQ_CST);
 	}
-	memcpy(c->key, key, AES_BLOCK_SIZE);
-	memcpy(c->encrypt_iv, eiv, AES_BLOCK_SIZE);
-	memcpy(c->decrypt_iv, div, AES_BLOCK_SIZE);
-	AES_set_encrypt_key(key, 128, &c->encrypt_key);
-	AES_set_decrypt_key(key, 128, &c->decrypt_key);
-	c->good = c->late = c->lost = c->resync = 0;
-	timer_new(&c->last_good);
+}
+
+static void crypt_key_release(struct crypt_key *k) {
+	__atomic_sub_fetch(&k->readers, 1, __ATOMIC_RELEASE);
+}
+
+void crypt_reset(struct crypt *c) {
+	memset(c, 0, sizeof(struct crypt));
+
+	pthread_mutex_init(&c->rx.pending.m_pending, NULL);
+}
+
+void crypt_free(struct crypt *c) {
+	if (c->rx.encrypt) EVP_CIPHER_CTX_free(c->rx.encrypt);
+	if (c->rx.decrypt) EVP_CIPHER_CTX_free(c->rx.decrypt);
+
+	c->rx.encrypt = c->rx.decrypt = NULL;
+
+	pthread_mutex_destroy(&c->rx.pending.m_pending);
+
+	c->init = FALSE;
+}
+
+/*
+ * called by the engine only; the new encrypt key goes into the spare slot,
+ * which is only overwritten once the last sender of the generation before
+ * has let go of it, and the decrypt key is left for the receiver to pick up
+ */
+void crypt_init(struct crypt *c, const unsigned char *key, const unsigned char *eiv, const unsigned char *div) {
+	struct crypt_encrypt_context *tx = &c->tx;
+
+	uint32_t g = __atomic_load_n(&tx->generation, __ATOMIC_SEQ_CST);
+
+	struct crypt_key *k = &tx->slot[(g + 1) & 1];
+
+	while (__atomic_load_n(&k->readers, __ATOMIC_SEQ_CST)) sched_yield();
+
+	memcpy(k->key, key, AES_BLOCK_SIZE);
+	memcpy(k->iv, eiv, AES_BLOCK_SIZE);
+	k->sequence = 0;
+	AES_set_encrypt_key(key, 128, &k->encrypt_key);
+	k->id = __atomic_add_fetch(&crypt_keys, 1, __ATOMIC_SEQ_CST);
+
+	/* EVP picks AES-NI on its own, without it the table based code below is just as fast */
+	tx->accelerated = crypt_has_aesni();
+
+	__atomic_store_n(&tx->generation, g + 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&c->rx.pending.m_pending);
+
+	memcpy(c->rx.pending.key, key, AES_BLOCK_SIZE);
+	memcpy(c->rx.pending.iv, div, AES_BLOCK_SIZE);
+	__atomic_store_n(&c->rx.pending.type, CRYPT_PENDING_KEY, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&c->rx.pending.m_pending);
+
+	__atomic_store_n(&c->resync, 0, __ATOMIC_RELAXED);
 	timer_new(&c->last_request);
 	c->request = FALSE;
-	c->init = TRUE;
+	__atomic_store_n(&c->init, TRUE, __ATOMIC_RELEASE);
+}
+
+/* the server's nonce is handed over to the receiver, which applies it before decrypting the next packet */
+void crypt_resync(struct crypt *c, const unsigned char *div) {
+	pthread_mutex_lock(&c->rx.pending.m_pending);
+
+	memcpy(c->rx.pending.iv, div, AES_BLOCK_SIZE);
+	if (c->rx.pending.type != CRYPT_PENDING_KEY) {
+		__atomic_store_n(&c->rx.pending.type, CRYPT_PENDING_RESYNC, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&c->rx.pending.m_pending);
+
+	__atomic_add_fetch(&c->resync, 1, __ATOMIC_RELAXED);
+}
+
+static void crypt_apply_pending(struct crypt *c) {
+	struct crypt_decrypt_context *rx = &c->rx;
+
+	pthread_mutex_lock(&rx->pending.m_pending);
+
+	if (rx->pending.type == CRYPT_PENDING_KEY) {
+		memset(rx->history, 0, 0x100);
+
+		AES_set_encrypt_key(rx->pending.key, 128, &rx->encrypt_key);
+		AES_set_decrypt_key(rx->pending.key, 128, &rx->decrypt_key);
+
+		rx->accelerated = FALSE;
+
+		if (crypt_has_aesni()) {
+			if ((rx->encrypt = crypt_evp_init(rx->encrypt, rx->pending.key, TRUE)) && (rx->decrypt = crypt_evp_init(rx->decrypt, rx->pending.key, FALSE))) {
+				rx->accelerated = TRUE;
+			} else {
+				console_warning(_CLASS, _NONE, "failed to set up AES-NI cipher, falling back to software implementation\n");
+			}
+		}
+
+		__atomic_store_n(&c->good, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&c->late, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&c->lost, 0, __ATOMIC_RELAXED);
+		timer_new(&c->last_good);
+	}
+
+	memcpy(rx->iv, rx->pending.iv, AES_BLOCK_SIZE);
+
+	__atomic_store_n(&rx->pending.type, CRYPT_PENDING_NONE, __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&rx->pending.m_pending);
+}
+
+/* the nonce the next packet will be sent with, as reported to the server */
+void crypt_get_encrypt_iv(struct crypt *c, unsigned char *iv) {
+	struct crypt_key *k = crypt_key_acquire(&c->tx);
+
+	crypt_iv_add(iv, k->iv, __atomic_load_n(&k->sequence, __ATOMIC_RELAXED));
+
+	crypt_key_release(k);
 }
 
 #if defined(__LP64__)
@@ -81,16 +295,16 @@ static void inline S3(subblock *block) {
 	block[BLOCKSIZE - 1] ^= SWAPPED((SWAPPED(block[BLOCKSIZE - 1]) << 1) ^ (carry * 0x87));
 }
 
-static void crypt_ocb_encrypt(struct crypt *c, const unsigned char *plain, unsigned char *encrypted, unsigned int len, const unsigned char *nonce, unsigned char *tag) {
+static void crypt_ocb_encrypt(AES_KEY *key, const unsigned char *plain, unsigned char *encrypted, unsigned int len, const unsigned char *nonce, unsigned char *tag) {
 	keyblock checksum, delta, tmp, pad;
 
-	AES_encrypt(nonce, (unsigned char *) delta, &c->encrypt_key);
+	AES_encrypt(nonce, (unsigned char *) delta, key);
 	ZERO(checksum);
 
 	while (len > AES_BLOCK_SIZE) {
 		S2(delta);
 		XOR(tmp, delta, (subblock *) plain);
-		AES_encrypt((const unsigned char *) tmp, (unsigned char *) tmp, &c->encrypt_key);
+		AES_encrypt((const unsigned char *) tmp, (unsigned char *) tmp, key);
 		XOR((subblock *) encrypted, delta, tmp);
 		XOR(checksum, checksum, (const subblock *) plain);
 		len -= AES_BLOCK_SIZE;
@@ -102,7 +316,7 @@ static void crypt_ocb_encrypt(struct crypt *c, const unsigned char *plain, unsig
 	ZERO(tmp);
 	tmp[BLOCKSIZE - 1] = SWAPPED(len * 8);
 	XOR(tmp, tmp, delta);
-	AES_encrypt((const unsigned char *) tmp, (unsigned char *) pad, &c->encrypt_key);
+	AES_encrypt((const unsigned char *) tmp, (unsigned char *) pad, key);
 	memcpy(tmp, plain, len);
 	memcpy((unsigned char *) tmp + len, (const unsigned char *) pad + len, AES_BLOCK_SIZE - len);
 	XOR(checksum, checksum, tmp);
@@ -111,19 +325,19 @@ static void crypt_ocb_encrypt(struct crypt *c, const unsigned char *plain, unsig
 
 	S3(delta);
 	XOR(tmp, delta, checksum);
-	AES_encrypt((const unsigned char *) tmp, tag, &c->encrypt_key);
+	AES_encrypt((const unsigned char *) tmp, tag, key);
 }
 
-static void crypt_ocb_decrypt(struct crypt *c, const unsigned char *encrypted, unsigned char *plain, unsigned int len, const unsigned char *nonce, unsigned char *tag) {
+static void crypt_ocb_decrypt(struct crypt_decrypt_context *rx, const unsigned char *encrypted, unsigned char *plain, unsigned int len, const unsigned char *nonce, unsigned char *tag) {
 	keyblock checksum, delta, tmp, pad;
 
-	AES_encrypt(nonce, (unsigned char *) delta, &c->encrypt_key);
+	AES_encrypt(nonce, (unsigned char *) delta, &rx->encrypt_key);
 	ZERO(checksum);
 
 	while (len > AES_BLOCK_SIZE) {
 		S2(delta);
 		XOR(tmp, delta, (const subblock *) encrypted);
-		AES_decrypt((const unsigned char *) tmp, (unsigned char *) tmp, &c->decrypt_key);
+		AES_decrypt((const unsigned char *) tmp, (unsigned char *) tmp, &rx->decrypt_key);
 		XOR((subblock *) plain, delta, tmp);
 		XOR(checksum, checksum, (subblock *) plain);
 		len -= AES_BLOCK_SIZE;
@@ -135,7 +349,7 @@ static void crypt_ocb_decrypt(struct crypt *c, const unsigned char *encrypted, u
 	ZERO(tmp);
 	tmp[BLOCKSIZE - 1] = SWAPPED(len * 8);
 	XOR(tmp, tmp, delta);
-	AES_encrypt((const unsigned char *) tmp, (unsigned char *) pad, &c->encrypt_key);
+	AES_encrypt((const unsigned char *) tmp, (unsigned char *) pad, &rx->encrypt_key);
 	memset(tmp, 0, AES_BLOCK_SIZE);
 	memcpy(tmp, encrypted, len);
 	XOR(tmp, tmp, pad);
@@ -144,20 +358,124 @@ static void crypt_ocb_decrypt(struct crypt *c, const unsigned char *encrypted, u
 
 	S3(delta);
 	XOR(tmp, delta, checksum);
-	AES_encrypt((const unsigned char *) tmp, (unsigned char *) tag, &c->encrypt_key);
+	AES_encrypt((const unsigned char *) tmp, (unsigned char *) tag, &rx->encrypt_key);
+}
+
+/* ECB over whole blocks, which lets the cipher interleave several blocks per call */
+static inline void crypt_evp_blocks(EVP_CIPHER_CTX *ctx, const unsigned char *in, unsigned char *out, int n) {
+	int len;
+
+	EVP_CipherUpdate(ctx, out, &len, in, n * AES_BLOCK_SIZE);
+}
+
+/*
+ * same as crypt_ocb_encrypt, but the full blocks are whitened with their deltas
+ * up front so that up to CRYPT_BATCH_BLOCKS of them are encrypted in one go
+ */
+static void crypt_ocb_encrypt_evp(EVP_CIPHER_CTX *ctx, const unsigned char *plain, unsigned char *encrypted, unsigned int len, const unsigned char *nonce, unsigned char *tag) {
+	keyblock checksum, delta, tmp, pad;
+	keyblock deltas[CRYPT_BATCH_BLOCKS], blocks[CRYPT_BATCH_BLOCKS];
+
+	crypt_evp_blocks(ctx, nonce, (unsigned char *) delta, 1);
+	ZERO(checksum);
+
+	while (len > AES_BLOCK_SIZE) {
+		int i, n;
+		for (n = 0; n < CRYPT_BATCH_BLOCKS && len > AES_BLOCK_SIZE; n++) {
+			S2(delta);
+			memcpy(deltas[n], delta, AES_BLOCK_SIZE);
+			XOR(blocks[n], delta, (const subblock *) plain);
+			XOR(checksum, checksum, (const subblock *) plain);
+			len -= AES_BLOCK_SIZE;
+			plain += AES_BLOCK_SIZE;
+		}
+
+		crypt_evp_blocks(ctx, (const unsigned char *) blocks, (unsigned char *) blocks, n);
+
+		for (i = 0; i < n; i++) {
+			XOR((subblock *) encrypted, deltas[i], blocks[i]);
+			encrypted += AES_BLOCK_SIZE;
+		}
+	}
+
+	S2(delta);
+	ZERO(tmp);
+	tmp[BLOCKSIZE - 1] = SWAPPED(len * 8);
+	XOR(tmp, tmp, delta);
+	crypt_evp_blocks(ctx, (const unsigned char *) tmp, (unsigned char *) pad, 1);
+	memcpy(tmp, plain, len);
+	memcpy((unsigned char *) tmp + len, (const unsigned char *) pad + len, AES_BLOCK_SIZE - len);
+	XOR(checksum, checksum, tmp);
+	XOR(tmp, pad, tmp);
+	memcpy(encrypted, tmp, len);
+
+	S3(delta);
+	XOR(tmp, delta, checksum);
+	crypt_evp_blocks(ctx, (const unsigned char *) tmp, tag, 1);
 }
 
+static void crypt_ocb_decrypt_evp(EVP_CIPHER_CTX *ectx, EVP_CIPHER_CTX *dctx, const unsigned char *encrypted, unsigned char *plain, unsigned int len, const unsigned char *nonce, unsigned char *tag) {
+	keyblock checksum, delta, tmp, pad;
+	keyblock deltas[CRYPT_BATCH_BLOCKS], blocks[CRYPT_BATCH_BLOCKS];
+
+	crypt_evp_blocks(ectx, nonce, (unsigned char *) delta, 1);
+	ZERO(checksum);
+
+	while (len > AES_BLOCK_SIZE) {
+		int i, n;
+		for (n = 0; n < CRYPT_BATCH_BLOCKS && len > AES_BLOCK_SIZE; n++) {
+			S2(delta);
+			memcpy(deltas[n], delta, AES_BLOCK_SIZE);
+			XOR(blocks[n], delta, (const subblock *) encrypted);
+			len -= AES_BLOCK_SIZE;
+			encrypted += AES_BLOCK_SIZE;
+		}
+
+		crypt_evp_blocks(dctx, (const unsigned char *) blocks, (unsigned char *) blocks, n);
+
+		for (i = 0; i < n; i++) {
+			XOR((subblock *) plain, deltas[i], blocks[i]);
+			XOR(checksum, checksum, (subblock *) plain);
+			plain += AES_BLOCK_SIZE;
+		}
+	}
+
+	S2(delta);
+	ZERO(tmp);
+	tmp[BLOCKSIZE - 1] = SWAPPED(len * 8);
+	XOR(tmp, tmp, delta);
+	crypt_evp_blocks(ectx, (const unsigned char *) tmp, (unsigned char *) pad, 1);
+	memset(tmp, 0, AES_BLOCK_SIZE);
+	memcpy(tmp, encrypted, len);
+	XOR(tmp, tmp, pad);
+	XOR(checksum, checksum, tmp);
+	memcpy(plain, tmp, len);
+
+	S3(delta);
+	XOR(tmp, delta, checksum);
+	crypt_evp_blocks(ectx, (const unsigned char *) tmp, tag, 1);
+}
+
+/* may be called by several threads at once, nonces are reserved atomically */
 void crypt_encrypt(struct crypt *c, const unsigned char *src, unsigned char *dst, unsigned int len) {
+	unsigned char iv[AES_BLOCK_SIZE];
 	unsigned char tag[AES_BLOCK_SIZE];
 
-	int i;
-	for (i = 0; i < AES_BLOCK_SIZE; i++) {
-		if (++c->encrypt_iv[i]) break;
+	struct crypt_key *k = crypt_key_acquire(&c->tx);
+
+	crypt_iv_add(iv, k->iv, __atomic_add_fetch(&k->sequence, 1, __ATOMIC_RELAXED));
+
+	EVP_CIPHER_CTX *ctx = c->tx.accelerated ? crypt_get_cipher(k) : NULL;
+
+	if (ctx) {
+		crypt_ocb_encrypt_evp(ctx, src, dst + 4, len, iv, tag);
+	} else {
+		crypt_ocb_encrypt(&k->encrypt_key, src, dst + 4, len, iv, tag);
 	}
 
-	crypt_ocb_encrypt(c, src, dst + 4, len, c->encrypt_iv, tag);
+	crypt_key_release(k);
 
-	dst[0] = c->encrypt_iv[0];
+	dst[0] = iv[0];
 	dst[1] = tag[0];
 	dst[2] = tag[1];
 	dst[3] = tag[2];
@@ -166,6 +484,10 @@ void crypt_encrypt(struct crypt *c, const unsigned char *src, unsigned char *dst
 bool crypt_decrypt(struct crypt *c, const unsigned char *src, unsigned char *dst, unsigned int len) {
 	if (len < 4) return FALSE;
 
+	if (__atomic_load_n(&c->rx.pending.type, __ATOMIC_ACQUIRE) != CRYPT_PENDING_NONE) crypt_apply_pending(c);
+
+	struct crypt_decrypt_context *rx = &c->rx;
+
 	int i;
 
 	unsigned int plain_len = len - 4;
@@ -178,21 +500,21 @@ bool crypt_decrypt(struct crypt *c, const unsigned char *src, unsigned char *dst
 	int lost = 0;
 	int late = 0;
 
-	memcpy(save_iv, c->decrypt_iv, AES_BLOCK_SIZE);
+	memcpy(save_iv, rx->iv, AES_BLOCK_SIZE);
 
-	if (((c->decrypt_iv[0] + 1) & 0xFF) == iv) {
-		if (iv > c->decrypt_iv[0]) {
-			c->decrypt_iv[0] = iv;
-		} else if (iv < c->decrypt_iv[0]) {
-			c->decrypt_iv[0] = iv;
+	if (((rx->iv[0] + 1) & 0xFF) == iv) {
+		if (iv > rx->iv[0]) {
+			rx->iv[0] = iv;
+		} else if (iv < rx->iv[0]) {
+			rx->iv[0] = iv;
 			for (i = 1; i < AES_BLOCK_SIZE; i++) {
-				if (++c->decrypt_iv[i]) break;
+				if (++rx->iv[i]) break;
 			}
 		} else {
 			return FALSE;
 		}
 	} else {
-		int diff = iv - c->decrypt_iv[0];
+		int diff = iv - rx->iv[0];
 
 		if (diff > 128) {
 			diff -= 256;
@@ -200,58 +522,73 @@ bool crypt_decrypt(struct crypt *c, const unsigned char *src, unsigned char *dst
 			diff += 256;
 		}
 
-		if (iv < c->decrypt_iv[0] && (diff > -30) && (diff < 0)) {
+		if (iv < rx->iv[0] && (diff > -30) && (diff < 0)) {
 			late = 1;
 			lost = -1;
-			c->decrypt_iv[0] = iv;
+			rx->iv[0] = iv;
 			restore = TRUE;
-		} else if (iv > c->decrypt_iv[0] && (diff > -30) && (diff < 0)) {
+		} else if (iv > rx->iv[0] && (diff > -30) && (diff < 0)) {
 			late = 1;
 			lost = -1;
-			c->decrypt_iv[0] = iv;
+			rx->iv[0] = iv;
 			for (i = 1; i < AES_BLOCK_SIZE; i++) {
-				if (c->decrypt_iv[i]--) break;
+				if (rx->iv[i]--) break;
 			}
 			restore = TRUE;
-		} else if (iv > c->decrypt_iv[0] && (diff > 0)) {
-			lost = iv - c->decrypt_iv[0] - 1;
-			c->decrypt_iv[0] = iv;
-		} else if (iv < c->decrypt_iv[0] && (diff > 0)) {
-			lost = 256 - c->decrypt_iv[0] + iv - 1;
-			c->decrypt_iv[0] = iv;
+		} else if (iv > rx->iv[0] && (diff > 0)) {
+			lost = iv - rx->iv[0] - 1;
+			rx->iv[0] = iv;
+		} else if (iv < rx->iv[0] && (diff > 0)) {
+			lost = 256 - rx->iv[0] + iv - 1;
+			rx->iv[0] = iv;
 			for (i = 1; i < AES_BLOCK_SIZE; i++) {
-				if (++c->decrypt_iv[i]) break;
+				if (++rx->iv[i]) break;
 			}
 		} else {
 			return FALSE;
 		}
 
-		if (c->decrypt_history[c->decrypt_iv[0]] == c->decrypt_iv[1]) {
-			memcpy(c->decrypt_iv, save_iv, AES_BLOCK_SIZE);
+		if (rx->history[rx->iv[0]] == rx->iv[1]) {
+			memcpy(rx->iv, save_iv, AES_BLOCK_SIZE);
 			
 			return FALSE;
 		}
 	}
 
-	crypt_ocb_decrypt(c, src + 4, dst, plain_len, c->decrypt_iv, tag);
+	if (rx->accelerated) {
+		crypt_ocb_decrypt_evp(rx->encrypt, rx->decrypt, src + 4, dst, plain_len, rx->iv, tag);
+	} else {
+		crypt_ocb_decrypt(rx, src + 4, dst, plain_len, rx->iv, tag);
+	}
 
 	if (memcmp(tag, src + 1, 3) != 0) {
-		memcpy(c->decrypt_iv, save_iv, AES_BLOCK_SIZE);
+		memcpy(rx->iv, save_iv, AES_BLOCK_SIZE);
 
 		return FALSE;
 	}
 
-	c->decrypt_history[c->decrypt_iv[0]] = c->decrypt_iv[1];
+	rx->history[rx->iv[0]] = rx->iv[1];
 
 	if (restore) {
-		memcpy(c->decrypt_iv, save_iv, AES_BLOCK_SIZE);
+		memcpy(rx->iv, save_iv, AES_BLOCK_SIZE);
 	}
 
-	c->good++;
-	c->late += late;
-	c->lost += lost;
+	/* only this thread writes the counters, others read them through crypt_get_stats */
+	__atomic_store_n(&c->good, c->good + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->late, c->late + late, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->lost, c->lost + lost, __ATOMIC_RELAXED);
 
 	timer_restart(&c->last_good);
 	
-	return TRUE;;
+	return TRUE;
+}
+
+void crypt_get_stats(struct crypt *c, uint32_t *good, uint32_t *late, uint32_t *lost) {
+	*good = __atomic_load_n(&c->good, __ATOMIC_RELAXED);
+	*late = __atomic_load_n(&c->late, __ATOMIC_RELAXED);
+	*lost = __atomic_load_n(&c->lost, __ATOMIC_RELAXED);
+}
+
+uint32_t crypt_get_resync(struct crypt *c) {
+	return __atomic_load_n(&c->resync, __ATOMIC_RELAXED);
 }
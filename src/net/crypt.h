@@ -2,20 +2,64 @@
 #define CRYPT_H_
 
 #include <openssl/aes.h>
+#include <openssl/evp.h>
 #include <pthread.h>
+#include <stdint.h>
 
 #include "../timer.h"
 #include "../types.h"
 
 #define CRYPT_HEADER_SIZE 4
 
-struct crypt {
+#define CRYPT_BATCH_BLOCKS 8
+
+enum {
+	CRYPT_PENDING_NONE,
+	CRYPT_PENDING_KEY,
+	CRYPT_PENDING_RESYNC
+};
+
+/*
+ * one generation of encrypt key material; senders reserve nonces from
+ * sequence and pin the slot through readers while they use it
+ */
+struct crypt_key {
+	uint64_t id;
 	unsigned char key[AES_BLOCK_SIZE];
-	unsigned char encrypt_iv[AES_BLOCK_SIZE];
-	unsigned char decrypt_iv[AES_BLOCK_SIZE];
-	unsigned char decrypt_history[0x100];
+	unsigned char iv[AES_BLOCK_SIZE];
+	uint64_t sequence;
+	AES_KEY encrypt_key;
+	uint32_t readers;
+};
+
+/* shared by all sending threads, written only by crypt_init */
+struct crypt_encrypt_context {
+	struct crypt_key slot[2];
+	uint32_t generation;
+	bool accelerated;
+};
+
+/* owned by the receiving thread, crypt_init and crypt_resync only leave a pending update */
+struct crypt_decrypt_context {
+	unsigned char iv[AES_BLOCK_SIZE];
+	unsigned char history[0x100];
 	AES_KEY encrypt_key;
 	AES_KEY decrypt_key;
+	/* deltas and tags need the forward cipher as well */
+	EVP_CIPHER_CTX *encrypt;
+	EVP_CIPHER_CTX *decrypt;
+	bool accelerated;
+	struct {
+		int type;
+		unsigned char key[AES_BLOCK_SIZE];
+		unsigned char iv[AES_BLOCK_SIZE];
+		pthread_mutex_t m_pending;
+	} pending;
+};
+
+struct crypt {
+	struct crypt_encrypt_context tx;
+	struct crypt_decrypt_context rx;
 	bool init;
 	uint32_t good;
 	uint32_t late;
@@ -26,10 +70,22 @@ struct crypt {
 	bool request;
 };
 
+void crypt_reset(struct crypt *);
+
 void crypt_init(struct crypt *, const unsigned char *, const unsigned char *, const unsigned char *);
 
+void crypt_resync(struct crypt *, const unsigned char *);
+
+void crypt_free(struct crypt *);
+
+void crypt_get_encrypt_iv(struct crypt *, unsigned char *);
+
 void crypt_encrypt(struct crypt *, const unsigned char *, unsigned char *, unsigned int);
 
 bool crypt_decrypt(struct crypt *, const unsigned char *, unsigned char *, unsigned int);
 
+void crypt_get_stats(struct crypt *, uint32_t *, uint32_t *, uint32_t *);
+
+uint32_t crypt_get_resync(struct crypt *);
+
 #endif
@@ -1,11 +1,16 @@
 #include <arpa/inet.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "../arena.h"
 #include "connection.h"
+#include "../console.h"
 #include "message.h"
 #include "audio.h"
 #include "../types.h"
 
+#define _CLASS "message"
+
 #define MESSAGE_HEADER_SIZE (sizeof(uint16_t) + sizeof(uint32_t))
 
 #define set_message_type(m, t) *(uint16_t *)(m) = htons(t)
@@ -46,7 +51,6 @@ const char *s_message[] = {
 typedef size_t (*_get_packed_size)(void *);
 typedef size_t (*_pack)(void *, uint8_t *);
 typedef void * (*_unpack)(void *, size_t len, const uint8_t *);
-typedef void (*_free_unpacked)(void *, void *);
 
 static _get_packed_size message_get_packed_size[] = {
 	(_get_packed_size) mumble_proto__version__get_packed_size,
@@ -132,110 +136,216 @@ static _unpack message_unpack[] = {
 	(_unpack) mumble_proto__server_config__unpack
 };
 
-static _free_unpacked message_free_unpacked[] = {
-	(_free_unpacked) mumble_proto__version__free_unpacked,
-	(_free_unpacked) mumble_proto__udptunnel__free_unpacked,
-	(_free_unpacked) mumble_proto__authenticate__free_unpacked,
-	(_free_unpacked) mumble_proto__ping__free_unpacked,
-	(_free_unpacked) mumble_proto__reject__free_unpacked,
-	(_free_unpacked) mumble_proto__server_sync__free_unpacked,
-	(_free_unpacked) mumble_proto__channel_remove__free_unpacked,
-	(_free_unpacked) mumble_proto__channel_state__free_unpacked,
-	(_free_unpacked) mumble_proto__user_remove__free_unpacked,
-	(_free_unpacked) mumble_proto__user_state__free_unpacked,
-	(_free_unpacked) mumble_proto__ban_list__free_unpacked,
-	(_free_unpacked) mumble_proto__text_message__free_unpacked,
-	(_free_unpacked) mumble_proto__permission_denied__free_unpacked,
-	(_free_unpacked) mumble_proto__acl__free_unpacked,
-	(_free_unpacked) mumble_proto__query_users__free_unpacked,
-	(_free_unpacked) mumble_proto__crypt_setup__free_unpacked,
-	(_free_unpacked) mumble_proto__context_action_add__free_unpacked,
-	(_free_unpacked) mumble_proto__context_action__free_unpacked,
-	(_free_unpacked) mumble_proto__user_list__free_unpacked,
-	(_free_unpacked) mumble_proto__voice_target__free_unpacked,
-	(_free_unpacked) mumble_proto__permission_query__free_unpacked,
-	(_free_unpacked) mumble_proto__codec_version__free_unpacked,
-	(_free_unpacked) mumble_proto__user_stats__free_unpacked,
-	(_free_unpacked) mumble_proto__request_blob__free_unpacked,
-	(_free_unpacked) mumble_proto__server_config__free_unpacked
-};
+/*
+ * tunneled audio is serialized without protobuf right where it is going to be
+ * sent from: the write buffer on the engine thread, a send queue slot otherwise
+ */
+static int message_send_tunnel(struct connection *con, struct packet *p) {
+	unsigned char *buf = control_reserve(con, MESSAGE_HEADER_SIZE + UDP_BUFFER_SIZE);
+	if (buf) {
+		int len = audio_serialize(p, buf + MESSAGE_HEADER_SIZE, UDP_BUFFER_SIZE);
+		if (len < 0) return -1;
+
+		set_message_type(buf, m_UDPTUNNEL);
+		set_message_length(buf, len);
+
+		control_commit(con, MESSAGE_HEADER_SIZE + len);
+
+		return MESSAGE_HEADER_SIZE + len;
+	}
+
+	struct control_slot *slot = control_queue_reserve(con);
+	if (!slot) return -1;
+
+	int len = audio_serialize(p, slot->buf + MESSAGE_HEADER_SIZE, CONTROL_SLOT_SIZE - MESSAGE_HEADER_SIZE);
+	if (len < 0) {
+		slot->buf = malloc(MESSAGE_HEADER_SIZE + UDP_BUFFER_SIZE);
+
+		if ((len = audio_serialize(p, slot->buf + MESSAGE_HEADER_SIZE, UDP_BUFFER_SIZE)) < 0) {
+			control_queue_commit(con, slot, 0);
+
+			return -1;
+		}
+	}
+
+	set_message_type(slot->buf, m_UDPTUNNEL);
+	set_message_length(slot->buf, len);
+
+	control_queue_commit(con, slot, MESSAGE_HEADER_SIZE + len);
+
+	return MESSAGE_HEADER_SIZE + len;
+}
 
 int message_send(struct connection *con, uint16_t type, void *message) {
 	if (!message_type_is_valid(type)) return -1;
 
-	uint32_t len;
-	unsigned char *buf;
-
-	if (type != m_UDPTUNNEL) {
-		len = message_get_packed_size[type](message);
+	if (type == m_UDPTUNNEL) return message_send_tunnel(con, (struct packet *) message);
 
-		buf = malloc(MESSAGE_HEADER_SIZE + len);
+	uint32_t len = message_get_packed_size[type](message);
 
+	/* the engine packs straight into the connection's write buffer */
+	unsigned char *buf = control_reserve(con, MESSAGE_HEADER_SIZE + len);
+	if (buf) {
 		message_pack[type](message, buf + MESSAGE_HEADER_SIZE);
-	} else {
-		buf = malloc(MESSAGE_HEADER_SIZE);
 
-		len = audio_serialize((struct packet *) message, &buf, MESSAGE_HEADER_SIZE);
+		set_message_type(buf, type);
+		set_message_length(buf, len);
+
+		control_commit(con, MESSAGE_HEADER_SIZE + len);
+
+		return MESSAGE_HEADER_SIZE + len;
 	}
 
+	unsigned char frame[CONTROL_SLOT_SIZE];
+
+	buf = (MESSAGE_HEADER_SIZE + len > CONTROL_SLOT_SIZE) ? malloc(MESSAGE_HEADER_SIZE + len) : frame;
+
+	message_pack[type](message, buf + MESSAGE_HEADER_SIZE);
+
 	set_message_type(buf, type);
 	set_message_length(buf, len);
 
 	int r = control_send(con, buf, MESSAGE_HEADER_SIZE + len);
 
-	free(buf);
+	if (buf != frame) free(buf);
 
 	return r;
 }
 
-int message_recv(struct connection *con, uint16_t *type, void **message) {
-	unsigned char header[MESSAGE_HEADER_SIZE];
+static void * message_arena_alloc(void *data, size_t size) {
+	return arena_alloc((struct arena *) data, size);
+}
 
-	int r;
+/* everything is released at once by message_free_all */
+static void message_arena_free(void *data, void *p) {}
+
+/*
+ * control data is read in chunks as large as the receive buffer allows and
+ * messages are unpacked straight out of it; returns 0 as long as no complete
+ * message is available
+ *
+ * listening has bit t set for every message type t somebody handles, the
+ * bodies of all other messages are dropped as they come in without being
+ * buffered or unpacked
+ */
+int message_recv(struct connection *con, uint32_t listening, uint16_t *type, void **message) {
+	unsigned char *buf;
+	int need, r;
 
-	if ((r = control_recv(con, header, MESSAGE_HEADER_SIZE)) <= 0) {
-		return r;
-	}
+	while (TRUE) {
+		int avail = con->channel.control.rx.tail - con->channel.control.rx.head;
 
-	uint16_t t;
-	uint32_t len;
+		if (con->channel.control.rx.skip) {
+			int n = avail < con->channel.control.rx.skip ? avail : con->channel.control.rx.skip;
 
-	t = get_message_type(header);
-	len = get_message_length(header);
+			con->channel.control.rx.head += n;
+			con->channel.control.rx.skip -= n;
+			avail -= n;
+		}
 
-	*type = t;
+		if (!avail) {
+			con->channel.control.rx.head = 0;
+			con->channel.control.rx.tail = 0;
+		}
+
+		buf = con->channel.control.rx.buf + con->channel.control.rx.head;
 
-	if (!message_type_is_valid(t)) return -1;
+		if (con->channel.control.rx.skip) {
+			need = 0;
+		} else if (avail < MESSAGE_HEADER_SIZE) {
+			need = MESSAGE_HEADER_SIZE;
+		} else {
+			if (!message_type_is_valid(get_message_type(buf))) {
+				console_error(_CLASS, _NONE, "received message of unknown type %u\n", get_message_type(buf));
 
-	unsigned char *buf = malloc(len);
+				return -1;
+			}
 
-	/*if ((r = control_recv(con, buf, len)) < 0) {
-		free(buf);
+			if (get_message_length(buf) > MESSAGE_MAX_SIZE) {
+				console_error(_CLASS, _NONE, "received %s message exceeds size limit (%u bytes)\n", s_message[get_message_type(buf)], get_message_length(buf));
 
-		return -1;
-	}*/
+				return -1;
+			}
 
-	do {
-		r = control_recv(con, buf, len);
-	} while (!r);
+			if (!(listening & (1 << get_message_type(buf)))) {
+				con->channel.control.rx.skip = get_message_length(buf);
+				con->channel.control.rx.head += MESSAGE_HEADER_SIZE;
 
-	if (r > 0) {
-		if (t != m_UDPTUNNEL) {
-			*message = message_unpack[t](NULL, len, buf);
-		} else {
-			audio_deserialize((struct packet **) message, buf, len);
+				continue;
+			}
+
+			need = MESSAGE_HEADER_SIZE + get_message_length(buf);
+
+			if (avail >= need) break;
+		}
+
+		/* the message has to be contiguous, move what is left of the buffer to the front */
+		if (con->channel.control.rx.head + need > con->channel.control.rx.size) {
+			memmove(con->channel.control.rx.buf, buf, avail);
+
+			con->channel.control.rx.head = 0;
+			con->channel.control.rx.tail = avail;
+
+			if (need > con->channel.control.rx.size) {
+				int size = con->channel.control.rx.size;
+
+				while (size < need) size *= 2;
+
+				con->channel.control.rx.buf = realloc(con->channel.control.rx.buf, size);
+				con->channel.control.rx.size = size;
+			}
+
+			continue;
 		}
+
+		if ((r = control_recv(con, con->channel.control.rx.buf + con->channel.control.rx.tail, con->channel.control.rx.size - con->channel.control.rx.tail)) <= 0) {
+			return r;
+		}
+
+		con->channel.control.rx.tail += r;
 	}
 
-	free(buf);
+	uint16_t t = get_message_type(buf);
+	uint32_t len = get_message_length(buf);
 
-	return r;
-}
+	con->channel.control.rx.head += need;
+
+	if (con->channel.control.rx.head == con->channel.control.rx.tail) {
+		con->channel.control.rx.head = 0;
+		con->channel.control.rx.tail = 0;
+	}
+
+	*type = t;
+
+	/*
+	 * buf stays valid until the next call, unpacking copies whatever it keeps
+	 * into the connection's arena; handlers have to copy anything they want
+	 * to hold on to past the current engine iteration
+	 */
+	if (t != m_UDPTUNNEL) {
+		ProtobufCAllocator allocator = { message_arena_alloc, message_arena_free, con->channel.control.arena };
 
-void message_free(uint16_t type, void *message) {
-	if (type != m_UDPTUNNEL) {
-		message_free_unpacked[type](message, NULL);
+		*message = message_unpack[t](&allocator, len, buf + MESSAGE_HEADER_SIZE);
 	} else {
-		audio_free((struct packet *) message);
+		/* the UDPTunnel payload is a plain voice datagram, its frames are only valid until the next call */
+		struct packet *p = arena_alloc(con->channel.control.arena, sizeof(struct packet) + AUDIO_MAX_FRAMES * sizeof(struct audio));
+
+		p->pool = NULL;
+		p->payload.audio = (struct audio *) (p + 1);
+
+		*message = (audio_deserialize_view(p, buf + MESSAGE_HEADER_SIZE, len) < 0) ? NULL : p;
 	}
+
+	if (!*message) {
+		console_error(_CLASS, _NONE, "failed to unpack %s message (%u bytes)\n", s_message[t], len);
+
+		return -1;
+	}
+
+	return MESSAGE_HEADER_SIZE + len;
+}
+
+/* releases every message received since the last call, tunneled audio included */
+void message_free_all(struct connection *con) {
+	arena_reset(con->channel.control.arena);
 }
@@ -38,6 +38,9 @@ enum {
 
 #define NUM_MESSAGES __OUT_OF_BOUNDS
 
+/* the limit enforced by the reference server implementation */
+#define MESSAGE_MAX_SIZE 0x7FFFFF
+
 extern const char *s_message[];
 
 #define message_type_is_valid(t) ((t >= 0) && (t < __OUT_OF_BOUNDS))
@@ -52,8 +55,8 @@ extern const char *s_message[];
 
 int message_send(struct connection *, uint16_t, void *);
 
-int message_recv(struct connection *, uint16_t *, void **);
+int message_recv(struct connection *, uint32_t, uint16_t *, void **);
 
-void message_free(uint16_t, void *);
+void message_free_all(struct connection *);
 
 #endif /* MESSAGE_H_ */
@@ -1233,7 +1233,7 @@ const ProtobufCMessageDescriptor mumble_proto__udptunnel__descriptor =
   (ProtobufCMessageInit) mumble_proto__udptunnel__init,
   NULL,NULL,NULL    /* reserved[123] */
 };
-static const ProtobufCFieldDescriptor mumble_proto__authenticate__field_descriptors[4] =
+static const ProtobufCFieldDescriptor mumble_proto__authenticate__field_descriptors[5] =
 {
   {
     "username",
@@ -1283,9 +1283,22 @@ static const ProtobufCFieldDescriptor mumble_proto__authenticate__field_descript
     0,             /* flags */
     0,NULL,NULL    /* reserved1,reserved2, etc */
   },
+  {
+    "opus",
+    5,
+    PROTOBUF_C_LABEL_OPTIONAL,
+    PROTOBUF_C_TYPE_BOOL,
+    offsetof(MumbleProto__Authenticate, has_opus),
+    offsetof(MumbleProto__Authenticate, opus),
+    NULL,
+    NULL,
+    0,             /* flags */
+    0,NULL,NULL    /* reserved1,reserved2, etc */
+  },
 };
 static const unsigned mumble_proto__authenticate__field_indices_by_name[] = {
   3,   /* field[3] = celt_versions */
+  4,   /* field[4] = opus */
   1,   /* field[1] = password */
   2,   /* field[2] = tokens */
   0,   /* field[0] = username */
@@ -1293,7 +1306,7 @@ static const unsigned mumble_proto__authenticate__field_indices_by_name[] = {
 static const ProtobufCIntRange mumble_proto__authenticate__number_ranges[1 + 1] =
 {
   { 1, 0 },
-  { 0, 4 }
+  { 0, 5 }
 };
 const ProtobufCMessageDescriptor mumble_proto__authenticate__descriptor =
 {
@@ -1303,7 +1316,7 @@ const ProtobufCMessageDescriptor mumble_proto__authenticate__descriptor =
   "MumbleProto__Authenticate",
   "MumbleProto",
   sizeof(MumbleProto__Authenticate),
-  4,
+  5,
   mumble_proto__authenticate__field_descriptors,
   mumble_proto__authenticate__field_indices_by_name,
   1,  mumble_proto__authenticate__number_ranges,
@@ -3586,7 +3599,7 @@ const ProtobufCMessageDescriptor mumble_proto__permission_query__descriptor =
   NULL,NULL,NULL    /* reserved[123] */
 };
 static const protobuf_c_boolean mumble_proto__codec_version__prefer_alpha__default_value = 1;
-static const ProtobufCFieldDescriptor mumble_proto__codec_version__field_descriptors[3] =
+static const ProtobufCFieldDescriptor mumble_proto__codec_version__field_descriptors[4] =
 {
   {
     "alpha",
@@ -3624,16 +3637,29 @@ static const ProtobufCFieldDescriptor mumble_proto__codec_version__field_descrip
     0,             /* flags */
     0,NULL,NULL    /* reserved1,reserved2, etc */
   },
+  {
+    "opus",
+    4,
+    PROTOBUF_C_LABEL_OPTIONAL,
+    PROTOBUF_C_TYPE_BOOL,
+    offsetof(MumbleProto__CodecVersion, has_opus),
+    offsetof(MumbleProto__CodecVersion, opus),
+    NULL,
+    NULL,
+    0,             /* flags */
+    0,NULL,NULL    /* reserved1,reserved2, etc */
+  },
 };
 static const unsigned mumble_proto__codec_version__field_indices_by_name[] = {
   0,   /* field[0] = alpha */
   1,   /* field[1] = beta */
+  3,   /* field[3] = opus */
   2,   /* field[2] = prefer_alpha */
 };
 static const ProtobufCIntRange mumble_proto__codec_version__number_ranges[1 + 1] =
 {
   { 1, 0 },
-  { 0, 3 }
+  { 0, 4 }
 };
 const ProtobufCMessageDescriptor mumble_proto__codec_version__descriptor =
 {
@@ -3643,7 +3669,7 @@ const ProtobufCMessageDescriptor mumble_proto__codec_version__descriptor =
   "MumbleProto__CodecVersion",
   "MumbleProto",
   sizeof(MumbleProto__CodecVersion),
-  3,
+  4,
   mumble_proto__codec_version__field_descriptors,
   mumble_proto__codec_version__field_indices_by_name,
   1,  mumble_proto__codec_version__number_ranges,
@@ -116,10 +116,12 @@ struct  _MumbleProto__Authenticate
   char **tokens;
   size_t n_celt_versions;
   int32_t *celt_versions;
+  protobuf_c_boolean has_opus;
+  protobuf_c_boolean opus;
 };
 #define MUMBLE_PROTO__AUTHENTICATE__INIT \
  { PROTOBUF_C_MESSAGE_INIT (&mumble_proto__authenticate__descriptor) \
-    , NULL, NULL, 0,NULL, 0,NULL }
+    , NULL, NULL, 0,NULL, 0,NULL, 0,0 }
 
 
 struct  _MumbleProto__Ping
@@ -552,10 +554,12 @@ struct  _MumbleProto__CodecVersion
   int32_t alpha;
   int32_t beta;
   protobuf_c_boolean prefer_alpha;
+  protobuf_c_boolean has_opus;
+  protobuf_c_boolean opus;
 };
 #define MUMBLE_PROTO__CODEC_VERSION__INIT \
  { PROTOBUF_C_MESSAGE_INIT (&mumble_proto__codec_version__descriptor) \
-    , 0, 0, 1 }
+    , 0, 0, 1, 0,0 }
 
 
 struct  _MumbleProto__UserStats__Stats
@@ -0,0 +1,191 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../console.h"
+#include "reactor.h"
+#include "../types.h"
+
+#define _CLASS "reactor"
+
+static void reactor_on_wakeup(struct reactor *r, struct reactor_handler *h, uint32_t events) {
+	uint64_t n;
+	while (read(h->fd, &n, sizeof(uint64_t)) > 0);
+}
+
+int reactor_init(struct reactor *r) {
+	r->stop = FALSE;
+	r->idle = NULL;
+	r->arg = NULL;
+
+	if ((r->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		console_error(_CLASS, _NONE, "failed to create epoll instance (%s)\n", strerror(errno));
+
+		return -1;
+	}
+
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) {
+		console_error(_CLASS, _NONE, "failed to create wakeup eventfd (%s)\n", strerror(errno));
+
+		close(r->epfd);
+
+		return -1;
+	}
+
+	r->wakeup = reactor_handler_new(fd, EPOLLIN, reactor_on_wakeup, NULL);
+
+	if (reactor_add(r, &r->wakeup)) {
+		close(fd);
+		close(r->epfd);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+void reactor_free(struct reactor *r) {
+	close(r->wakeup.fd);
+	close(r->epfd);
+}
+
+int reactor_add(struct reactor *r, struct reactor_handler *h) {
+	struct epoll_event ev = { .events = h->events, .data.ptr = h };
+
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, h->fd, &ev)) {
+		console_error(_CLASS, _NONE, "failed to register descriptor %i (%s)\n", h->fd, strerror(errno));
+
+		return -1;
+	}
+
+	return 0;
+}
+
+int reactor_modify(struct reactor *r, struct reactor_handler *h, uint32_t events) {
+	if (h->events == events) return 0;
+
+	struct epoll_event ev = { .events = events, .data.ptr = h };
+
+	if (epoll_ctl(r->epfd, EPOLL_CTL_MOD, h->fd, &ev)) {
+		console_error(_CLASS, _NONE, "failed to modify descriptor %i (%s)\n", h->fd, strerror(errno));
+
+		return -1;
+	}
+
+	h->events = events;
+
+	return 0;
+}
+
+void reactor_remove(struct reactor *r, struct reactor_handler *h) {
+	/* kernels before 2.6.9 require a non-NULL event even though it is ignored */
+	struct epoll_event ev;
+
+	epoll_ctl(r->epfd, EPOLL_CTL_DEL, h->fd, &ev);
+}
+
+/*
+ * dispatches readiness callbacks until reactor_stop is called; there is no
+ * timeout, periodic work has to be registered as a timer descriptor
+ */
+int reactor_run(struct reactor *r) {
+	struct epoll_event events[REACTOR_MAX_EVENTS];
+
+	while (!r->stop) {
+		if (r->idle) {
+			r->idle(r, r->arg);
+
+			if (r->stop) break;
+		}
+
+		int n = epoll_wait(r->epfd, events, REACTOR_MAX_EVENTS, -1);
+
+		if (n < 0) {
+			if (errno == EINTR) continue;
+
+			console_error(_CLASS, _NONE, "failed to wait for events (%s)\n", strerror(errno));
+
+			return -1;
+		}
+
+		int i;
+		for (i = 0; i < n && !r->stop; i++) {
+			struct reactor_handler *h = (struct reactor_handler *) events[i].data.ptr;
+
+			h->process(r, h, events[i].events);
+		}
+	}
+
+	return 0;
+}
+
+void reactor_stop(struct reactor *r) {
+	r->stop = TRUE;
+
+	uint64_t n = 1;
+	write(r->wakeup.fd, &n, sizeof(uint64_t));
+}
+
+/* called every time before the reactor blocks, i.e. after a round of callbacks */
+void reactor_set_idle(struct reactor *r, void (*idle)(struct reactor *, void *), void *arg) {
+	r->idle = idle;
+	r->arg = arg;
+}
+
+/* an interval of 0 creates a disarmed timer, see reactor_timer_arm_tick */
+int reactor_timer_open(uint64_t interval) {
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		console_error(_CLASS, _NONE, "failed to create timer (%s)\n", strerror(errno));
+
+		return -1;
+	}
+
+	if (!interval) return fd;
+
+	struct itimerspec its;
+	its.it_interval.tv_sec = interval / 1000000ULL;
+	its.it_interval.tv_nsec = (interval % 1000000ULL) * 1000ULL;
+	its.it_value = its.it_interval;
+
+	if (timerfd_settime(fd, 0, &its, NULL)) {
+		console_error(_CLASS, _NONE, "failed to arm timer (%s)\n", strerror(errno));
+
+		close(fd);
+
+		return -1;
+	}
+
+	return fd;
+}
+
+/* fires once at the next multiple of tick (in microseconds) on the monotonic clock */
+int reactor_timer_arm_tick(int fd, uint64_t tick) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	uint64_t t = (uint64_t) now.tv_sec * 1000000ULL + now.tv_nsec / 1000ULL;
+	t = (t / tick + 1) * tick;
+
+	struct itimerspec its;
+	its.it_interval.tv_sec = 0;
+	its.it_interval.tv_nsec = 0;
+	its.it_value.tv_sec = t / 1000000ULL;
+	its.it_value.tv_nsec = (t % 1000000ULL) * 1000ULL;
+
+	return timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+uint64_t reactor_timer_read(int fd) {
+	uint64_t n = 0;
+
+	if (read(fd, &n, sizeof(uint64_t)) != sizeof(uint64_t)) return 0;
+
+	return n;
+}
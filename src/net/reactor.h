@@ -0,0 +1,52 @@
+#ifndef REACTOR_H_
+#define REACTOR_H_
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#include "../types.h"
+
+#define REACTOR_MAX_EVENTS 16
+
+struct reactor;
+
+struct reactor_handler {
+	int fd;
+	uint32_t events;
+	void (*process)(struct reactor *, struct reactor_handler *, uint32_t);
+	void *arg;
+};
+
+struct reactor {
+	int epfd;
+	struct reactor_handler wakeup;
+	void (*idle)(struct reactor *, void *);
+	void *arg;
+	bool stop;
+};
+
+#define reactor_handler_new(f, e, p, a) (struct reactor_handler) { .fd = f, .events = e, .process = p, .arg = a }
+
+int reactor_init(struct reactor *);
+
+void reactor_free(struct reactor *);
+
+int reactor_add(struct reactor *, struct reactor_handler *);
+
+int reactor_modify(struct reactor *, struct reactor_handler *, uint32_t);
+
+void reactor_remove(struct reactor *, struct reactor_handler *);
+
+int reactor_run(struct reactor *);
+
+void reactor_stop(struct reactor *);
+
+void reactor_set_idle(struct reactor *, void (*)(struct reactor *, void *), void *);
+
+int reactor_timer_open(uint64_t);
+
+int reactor_timer_arm_tick(int, uint64_t);
+
+uint64_t reactor_timer_read(int);
+
+#endif /* REACTOR_H_ */
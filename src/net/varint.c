@@ -1,116 +1,116 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "../types.h"
+#include "varint.h"
 
-int varint_decode(unsigned char *varint, uint64_t *v) {
-	int len = 0;
+/*
+ * everything about a varint is determined by its prefix byte: the total
+ * length (0 marks the negative prefix which is followed by another varint)
+ * and the bits of the prefix that belong to the value
+ */
+static const uint8_t varint_length[0x100] = {
+	[0x00 ... 0x7F] = 1,
+	[0x80 ... 0xBF] = 2,
+	[0xC0 ... 0xDF] = 3,
+	[0xE0 ... 0xEF] = 4,
+	[0xF0 ... 0xF3] = 5,
+	[0xF4 ... 0xF7] = 9,
+	[0xF8 ... 0xFB] = 0,
+	[0xFC ... 0xFF] = 1
+};
+
+static const uint8_t varint_mask[0x100] = {
+	[0x00 ... 0x7F] = 0x7F,
+	[0x80 ... 0xBF] = 0x3F,
+	[0xC0 ... 0xDF] = 0x1F,
+	[0xE0 ... 0xEF] = 0x0F,
+	[0xF0 ... 0xFB] = 0x00,
+	[0xFC ... 0xFF] = 0x03
+};
+
+/* length and prefix of a positive value, indexed by its number of significant bits */
+static const struct {
+	uint8_t len;
+	uint8_t prefix;
+} varint_prefix[65] = {
+	[0 ... 7] = { 1, 0x00 },
+	[8 ... 14] = { 2, 0x80 },
+	[15 ... 21] = { 3, 0xC0 },
+	[22 ... 28] = { 4, 0xE0 },
+	[29 ... 32] = { 5, 0xF0 },
+	[33 ... 64] = { 9, 0xF4 }
+};
+
+/*
+ * decodes at most len bytes; returns the number of bytes consumed or -1 if
+ * the varint is truncated or malformed
+ */
+int varint_decode(const unsigned char *varint, int len, uint64_t *v) {
+	if (len < 1) return -1;
 
 	uint8_t p = varint[0];
 
-	if ((p & 0x80) == 0x00) {
-		len = 1;
-		*v = p & 0x7F;
-	} else if ((p & 0xC0) == 0x80) {
-		len = 2;
-		*v = (p & 0x3F) << 8 | varint[1];
-	} else if ((p & 0xE0) == 0xC0) {
-		len = 3;
-		*v = (p & 0x1F) << 16 | varint[1] << 8 | varint[2];
-	} else if ((p & 0xF0) == 0xE0) {
-		len = 4;
-		*v = (p & 0x0F) << 24 | varint[1] << 16 | varint[2] << 8 | varint[3];
-	} else if ((p & 0xF0) == 0xF0) {
-		switch (p & 0x0C) {
-			case 0x00:
-				len = 5;
-				*v = varint[1] << 24 | varint[2] << 16 | varint[3] << 8 | varint[4];
-				break;
-			case 0x04:
-				len = 9;
-				*v = ((uint64_t) varint[1]) << 56 | ((uint64_t) varint[2]) << 48 | ((uint64_t) varint[3]) << 40 | ((uint64_t) varint[4]) << 32 | varint[5] << 24 | varint[6] << 16 | varint[7] << 8 | varint[8];
-				break;
-			case 0x08:
-				len = 1 + varint_decode(&varint[1], v);
-				*v = ~*v;
-				break;
-			case 0x0C:
-				len = 1;
-				*v = p & 0x03;
-				*v = ~*v;
-				break;
-			default:
-				*v = 0;
-				break;
-		}
+	if (p >= 0xF8 && p <= 0xFB) {
+		/* a negated varint, which must not be negated again */
+		if (len < 2 || (varint[1] >= 0xF8)) return -1;
+
+		int r = varint_decode(varint + 1, len - 1, v);
+		if (r < 0) return -1;
+
+		*v = ~*v;
+
+		return r + 1;
 	}
 
-	return len;
+	int n = varint_length[p];
+	if (n > len) return -1;
+
+	uint64_t value = p & varint_mask[p];
+
+	int i;
+	for (i = 1; i < n; i++) {
+		value = value << 8 | varint[i];
+	}
+
+	*v = (p >= 0xFC) ? ~value : value;
+
+	return n;
 }
 
-int varint_encode(uint64_t v, unsigned char **varint) {
-	int len = 0;
+/* writes into a caller-owned buffer, returns the number of bytes written or -1 if it is too small */
+int varint_encode(uint64_t v, unsigned char *varint, int size) {
 	int i = 0;
-	*varint = NULL;
 
 	if ((v & 0x8000000000000000LL) && (~v < 0x100000000LL)) {
+		if (size < 1) return -1;
+
 		v = ~v;
 
 		if (v <= 0x03) {
-			len = 1;
-			*varint = malloc(len);
-			(*varint)[i++] = 0xFC | v;
+			varint[i++] = 0xFC | v;
 
-			return len;
+			return i;
 		} else {
-			len += 1;
-			*varint = malloc(len);
-			(*varint)[i++] = 0xF8;
+			varint[i++] = 0xF8;
 		}
 	}
 
-	if (v < 0x80) {
-		len += 1;
-		*varint = realloc(*varint, len);
-		(*varint)[i++] = v;
-	} else if (v < 0x4000) {
-		len += 2;
-		*varint = realloc(*varint, len);
-		(*varint)[i++] = v >> 8 | 0x80;
-		(*varint)[i++] = v & 0xFF;
-	} else if (v < 0x200000) {
-		len += 3;
-		*varint = realloc(*varint, len);
-		(*varint)[i++] = v >> 16 | 0xC0;
-		(*varint)[i++] = v >> 8 & 0xFF;
-		(*varint)[i++] = v & 0xFF;
-	} else if (v < 0x10000000) {
-		len += 4;
-		*varint = realloc(*varint, len);
-		(*varint)[i++] = v >> 24 | 0xE0;
-		(*varint)[i++] = v >> 16 & 0xFF;
-		(*varint)[i++] = v >> 8 & 0xFF;
-		(*varint)[i++] = v & 0xFF;
-	} else if (v < 0x100000000LL) {
-		len += 5;
-		*varint = realloc(*varint, len);
-		(*varint)[i++] = 0xF0;
-		(*varint)[i++] = v >> 24 & 0xFF;
-		(*varint)[i++] = v >> 16 & 0xFF;
-		(*varint)[i++] = v >> 8 & 0xFF;
-		(*varint)[i++] = v & 0xFF;
-	} else {
-		len += 9;
-		*varint = realloc(*varint, len);
-		(*varint)[i++] = 0xF4;
-		(*varint)[i++] = v >> 56 & 0xFF;
-		(*varint)[i++] = v >> 48 & 0xFF;
-		(*varint)[i++] = v >> 40 & 0xFF;
-		(*varint)[i++] = v >> 32 & 0xFF;
-		(*varint)[i++] = v >> 24 & 0xFF;
-		(*varint)[i++] = v >> 16 & 0xFF;
-		(*varint)[i++] = v >> 8 & 0xFF;
-		(*varint)[i++] = v & 0xFF;
+	int bits = v ? 64 - __builtin_clzll(v) : 0;
+
+	int len = varint_prefix[bits].len;
+	if (i + len > size) return -1;
+
+	varint += i;
+
+	int j;
+	for (j = len - 1; j > 0; j--) {
+		varint[j] = v & 0xFF;
+		v >>= 8;
 	}
 
-	return len;
+	/* 5 and 9 byte forms carry no value bits in the prefix, v is 0 by now */
+	varint[0] = varint_prefix[bits].prefix | v;
+
+	return i + len;
 }
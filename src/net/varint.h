@@ -3,8 +3,10 @@
 
 #include "../types.h"
 
-int varint_decode(unsigned char *, uint64_t *);
+#define VARINT_MAX_SIZE 10
 
-int varint_encode(uint64_t, unsigned char **);
+int varint_decode(const unsigned char *, int, uint64_t *);
+
+int varint_encode(uint64_t, unsigned char *, int);
 
 #endif /* VARINT_H_ */